@@ -0,0 +1,199 @@
+#ifndef _JOBSYSTEM_H_
+#define _JOBSYSTEM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "Random.h"
+
+#define CACHE_LINE 64
+
+typedef void (*JobFunction)(void* context, void* data, unsigned int begin, unsigned int end);
+
+struct Job
+{
+	JobFunction function;
+	void* context;
+	void* data;
+	unsigned int begin, end;
+	std::atomic<int>* counter;
+};
+
+// Each worker owns a deque: it pops its own jobs from the back and idle
+// workers steal from the front. The padding keeps the per-worker generator
+// and counters of neighbouring workers on different cache lines.
+struct JobWorker
+{
+	std::mutex mutex;
+	std::deque<Job> jobs;
+	Random random;
+	unsigned int executed;
+	char padding[CACHE_LINE];
+};
+
+class JobSystem
+{
+public:
+
+	unsigned int workers_count;
+	JobWorker* workers;
+	std::thread* threads;
+
+	std::atomic<bool> running;
+	std::atomic<int> queued;
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+
+	JobSystem()
+	{
+		workers_count = 0;
+		workers = nullptr;
+		threads = nullptr;
+		running = false;
+		queued = 0;
+	}
+
+	~JobSystem()
+	{
+		running = false;
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			wake.notify_all();
+		}
+		for (unsigned int i = 1; i < workers_count; ++i) threads[i].join();
+		delete[] threads;
+		delete[] workers;
+	}
+
+	// Worker 0 is the calling thread; count 0 uses every hardware thread.
+	void Init(unsigned int count, unsigned int seed)
+	{
+		if (count == 0) count = std::thread::hardware_concurrency();
+		if (count == 0) count = 1;
+
+		workers_count = count;
+		workers = new JobWorker[workers_count];
+		threads = new std::thread[workers_count];
+		running = true;
+
+		for (unsigned int i = 0; i < workers_count; ++i)
+		{
+			workers[i].random.Seed(seed + i * 7919);
+			workers[i].executed = 0;
+		}
+
+		WorkerIndex() = 0;
+		for (unsigned int i = 1; i < workers_count; ++i)
+			threads[i] = std::thread(&JobSystem::WorkerLoop, this, i);
+	}
+
+	static unsigned int& WorkerIndex()
+	{
+		static thread_local unsigned int index = 0;
+		return index;
+	}
+
+	void Push(const Job& job)
+	{
+		JobWorker& worker = workers[WorkerIndex()];
+		{
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			worker.jobs.push_back(job);
+		}
+		++queued;
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		wake.notify_one();
+	}
+
+	// Runs queued jobs on the calling thread until every job tied to counter is done.
+	void Wait(std::atomic<int>& counter)
+	{
+		while (counter.load() > 0)
+			if (!RunOne(WorkerIndex())) std::this_thread::yield();
+	}
+
+	// Splits [begin, end) into chunks of chunk_size and runs them across the
+	// workers; ranges that fit in a single chunk run inline on the caller.
+	void ParallelFor(JobFunction function, void* context, void* data, unsigned int begin, unsigned int end, unsigned int chunk_size)
+	{
+		if (workers_count < 2 || chunk_size == 0 || end - begin <= chunk_size)
+		{
+			function(context, data, begin, end);
+			return;
+		}
+
+		unsigned int chunks = (end - begin + chunk_size - 1) / chunk_size;
+		std::atomic<int> pending(chunks - 1);
+		for (unsigned int chunk = 1; chunk < chunks; ++chunk)
+		{
+			unsigned int chunk_begin = begin + chunk * chunk_size;
+			unsigned int chunk_end = end - chunk_begin > chunk_size ? chunk_begin + chunk_size : end;
+			Push({ function, context, data, chunk_begin, chunk_end, &pending });
+		}
+		function(context, data, begin, begin + chunk_size);
+		Wait(pending);
+	}
+
+	bool RunOne(unsigned int self)
+	{
+		Job job;
+		if (!Pop(self, job))
+		{
+			unsigned int victim = self;
+			bool stolen = false;
+			for (unsigned int i = 1; i < workers_count && !stolen; ++i)
+			{
+				victim = (self + i) % workers_count;
+				stolen = Steal(victim, job);
+			}
+			if (!stolen) return false;
+		}
+
+		--queued;
+		job.function(job.context, job.data, job.begin, job.end);
+		++workers[self].executed;
+		--(*job.counter);
+		return true;
+	}
+
+private:
+
+	bool Pop(unsigned int index, Job& job)
+	{
+		JobWorker& worker = workers[index];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (worker.jobs.empty()) return false;
+		job = worker.jobs.back();
+		worker.jobs.pop_back();
+		return true;
+	}
+
+	bool Steal(unsigned int index, Job& job)
+	{
+		JobWorker& worker = workers[index];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (worker.jobs.empty()) return false;
+		job = worker.jobs.front();
+		worker.jobs.pop_front();
+		return true;
+	}
+
+	void WorkerLoop(unsigned int index)
+	{
+		WorkerIndex() = index;
+
+		while (running)
+		{
+			if (RunOne(index)) continue;
+
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			wake.wait(lock, [this] { return queued.load() > 0 || !running; });
+		}
+	}
+
+};
+
+#endif
@@ -40,6 +40,10 @@ int main(int argc, char** argv)
 {
 	bool active = true;
 
+	// -kernel scalar|sse41|avx2|avx512 overrides the PARTICLES_KERNEL environment variable
+	for (int i = 1; i + 1 < argc; ++i)
+		if (SDL_strcmp(argv[i], "-kernel") == 0) SDL_setenv("PARTICLES_KERNEL", argv[i + 1], 1);
+
 	SDL_Init(SDL_INIT_EVERYTHING);
 	IMG_Init(IMG_INIT_PNG);
 	TTF_Init();
@@ -106,6 +110,9 @@ int main(int argc, char** argv)
 				if (event.wheel.y > 0) scale += 0.1f;
 				else if (event.wheel.y < 0) scale -= 0.1f;
 				break;
+			case SDL_APP_LOWMEMORY:
+				particleSystem->atlas.Evict();
+				break;
 			}
 
 		const Uint8* keys = SDL_GetKeyboardState(0);
@@ -129,13 +136,14 @@ int main(int argc, char** argv)
 			cameray = (mouse[1] - offsety) / scale;
 		}
 
-		particleSystem->Update(dt, mouse, keyboard, scale);
+		particleSystem->Update(dt, mouse, keyboard, scale, camerax, cameray);
 
 		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 		SDL_RenderClear(renderer);
 
 		particleSystem->Draw(camerax, cameray);
 
+		const ParticleStats stats = particleSystem->Stats();
 		const unsigned int size = 512;
 		static char debug[size];
 		sprintf_s(debug, size, "FPS: %d", fps);
@@ -146,10 +154,20 @@ int main(int argc, char** argv)
 		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 90, 0.5f, debug);
 		sprintf_s(debug, size, "Camera: x %.f y %.f", camerax, cameray);
 		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 130, 0.5f, debug);
-		sprintf_s(debug, size, "Number of emitters: %d", particleSystem->emitters_count);
+		sprintf_s(debug, size, "Number of emitters: %d (textures: %d)", stats.emitters, stats.textures);
 		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 170, 0.5f, debug);
-		sprintf_s(debug, size, "Number of particles: %d", particleSystem->particles_count);
+		sprintf_s(debug, size, "Number of particles: %d", stats.particles);
 		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 210, 0.5f, debug);
+		sprintf_s(debug, size, "Kernel: %s", particleSystem->kernels.name);
+		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 250, 0.5f, debug);
+		sprintf_s(debug, size, "Workers: %d", particleSystem->jobs.workers_count);
+		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 290, 0.5f, debug);
+		sprintf_s(debug, size, "Latency: +%d frame", stats.latency_frames);
+		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 330, 0.5f, debug);
+		sprintf_s(debug, size, "Sleeping emitters: %d, deferred: %d", stats.sleeping, stats.deferred);
+		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 370, 0.5f, debug);
+		sprintf_s(debug, size, "Density: %.2f (update %.2f ms, draw %.2f ms)", stats.density, stats.update_ms, stats.draw_ms);
+		DrawFont(renderer, font, { 255,0,0,255 }, 0, 0, scale, 20, 410, 0.5f, debug);
 
 		SDL_RenderPresent(renderer);
 	}
@@ -0,0 +1,248 @@
+#ifndef _PARTICLEATLAS_H_
+#define _PARTICLEATLAS_H_
+
+#include <string.h>
+#include <algorithm>
+
+#include "SDL.h"
+#include "SDL_image.h"
+#include "pugixml.hpp"
+
+#define PARTICLE_ATLAS_PAGES 8
+#define PARTICLE_ATLAS_ENTRIES 64
+// transparent gap around each sprite so filtering never picks up a neighbour
+#define PARTICLE_ATLAS_PADDING 2
+
+// Where a sprite ended up: its page, its pixel rect and the same rect in
+// texture coordinates.
+struct AtlasEntry
+{
+	const char* path;
+	unsigned int page;
+	SDL_Rect source;
+	SDL_FRect uv;
+};
+
+// Packs every texture the particle types name into a few atlas pages at load
+// time, so emitters with different sprites share a texture and can be drawn
+// in one batch. Sprites go on shelves, tallest first; a shelf is as tall as
+// its first sprite and a page is cut down to the power of two its shelves
+// need. Page 0 also holds a white block that untextured particles sample.
+//
+// Every image is decoded once, into its page surface, and every page gets its
+// texture up front. When the last emitter releases a page its texture is not
+// destroyed at once, so an effect spawned again soon after never waits on an
+// upload: Age frees it once it has gone evict_frames frames without
+// references, Evict right away under memory pressure, and Acquire uploads an
+// evicted page again from its surface. Emitters come and go on the main
+// thread only, so the counts are plain integers.
+class ParticleAtlas
+{
+public:
+
+	SDL_Renderer* renderer;
+	SDL_Surface* surfaces[PARTICLE_ATLAS_PAGES];
+	SDL_Texture* pages[PARTICLE_ATLAS_PAGES];
+	unsigned int references[PARTICLE_ATLAS_PAGES];
+	// frames each page has gone without references
+	unsigned int idle[PARTICLE_ATLAS_PAGES];
+	unsigned int evict_frames;
+	unsigned int pages_count;
+	AtlasEntry entries[PARTICLE_ATLAS_ENTRIES];
+	unsigned int entries_count;
+	SDL_FRect solid_uv;
+
+	ParticleAtlas()
+	{
+		renderer = nullptr;
+		evict_frames = 0;
+		pages_count = entries_count = 0;
+		solid_uv = { 0.0f, 0.0f, 0.0f, 0.0f };
+	}
+
+	~ParticleAtlas()
+	{
+		for (unsigned int i = 0; i < pages_count; ++i)
+		{
+			if (pages[i]) SDL_DestroyTexture(pages[i]);
+			if (surfaces[i]) SDL_FreeSurface(surfaces[i]);
+		}
+	}
+
+	// types holds one child per particle type, each with a draw texture path;
+	// the paths are kept, so types must outlive the atlas.
+	void Build(SDL_Renderer* _renderer, pugi::xml_node types, int page_size, unsigned int _evict_frames)
+	{
+		renderer = _renderer;
+		evict_frames = _evict_frames;
+		SDL_Surface* images[PARTICLE_ATLAS_ENTRIES];
+		for (pugi::xml_node type = types.first_child(); type; type = type.next_sibling())
+		{
+			const char* path = type.child("draw").attribute("texture").as_string();
+			if (!*path || Find(path) || entries_count == PARTICLE_ATLAS_ENTRIES) continue;
+
+			SDL_Surface* image = IMG_Load(path);
+			if (!image)
+			{
+				printf("ERROR while loading particle texture %s: %s\n", path, IMG_GetError());
+				continue;
+			}
+			images[entries_count] = image;
+			entries[entries_count++].path = path;
+		}
+
+		// the solid block goes first, the sprites by decreasing height
+		unsigned int order[PARTICLE_ATLAS_ENTRIES];
+		for (unsigned int i = 0; i < entries_count; ++i) order[i] = i;
+		std::sort(order, order + entries_count, [&](unsigned int a, unsigned int b) { return images[a]->h > images[b]->h; });
+
+		SDL_Rect solid = { 0, 0, 4, 4 };
+		int shelf_x = solid.w + PARTICLE_ATLAS_PADDING, shelf_y = 0, shelf_h = solid.h + PARTICLE_ATLAS_PADDING;
+		int heights[PARTICLE_ATLAS_PAGES] = { shelf_h };
+		unsigned int page = 0;
+		for (unsigned int k = 0; k < entries_count; ++k)
+		{
+			AtlasEntry& entry = entries[order[k]];
+			const int w = images[order[k]]->w + PARTICLE_ATLAS_PADDING, h = images[order[k]]->h + PARTICLE_ATLAS_PADDING;
+			if (shelf_x > 0 && shelf_x + w > page_size)
+			{
+				shelf_x = 0;
+				shelf_y += shelf_h;
+				shelf_h = 0;
+			}
+			if (shelf_y > 0 && shelf_y + h > page_size && page + 1 < PARTICLE_ATLAS_PAGES)
+			{
+				++page;
+				shelf_x = shelf_y = shelf_h = 0;
+			}
+			entry.page = page;
+			entry.source = { shelf_x, shelf_y, w - PARTICLE_ATLAS_PADDING, h - PARTICLE_ATLAS_PADDING };
+			shelf_x += w;
+			shelf_h = SDL_max(shelf_h, h);
+			heights[page] = SDL_max(heights[page], shelf_y + shelf_h);
+		}
+
+		// a sprite larger than a page gets a page of its own size
+		int widths[PARTICLE_ATLAS_PAGES];
+		for (unsigned int i = 0; i <= page; ++i) widths[i] = page_size;
+		for (unsigned int i = 0; i < entries_count; ++i)
+			widths[entries[i].page] = SDL_max(widths[entries[i].page], entries[i].source.x + entries[i].source.w);
+
+		pages_count = page + 1;
+		for (unsigned int i = 0; i < pages_count; ++i)
+		{
+			pages[i] = nullptr;
+			references[i] = idle[i] = 0;
+			int height = 1;
+			while (height < heights[i]) height *= 2;
+			heights[i] = height;
+			surfaces[i] = SDL_CreateRGBSurfaceWithFormat(0, widths[i], height, 32, SDL_PIXELFORMAT_RGBA32);
+			if (surfaces[i]) SDL_FillRect(surfaces[i], nullptr, SDL_MapRGBA(surfaces[i]->format, 255, 255, 255, 0));
+		}
+		if (surfaces[0]) SDL_FillRect(surfaces[0], &solid, SDL_MapRGBA(surfaces[0]->format, 255, 255, 255, 255));
+		// the middle of the block, away from its blended edges
+		solid_uv = { 1.5f / widths[0], 1.5f / heights[0], 1.0f / widths[0], 1.0f / heights[0] };
+
+		for (unsigned int i = 0; i < entries_count; ++i)
+		{
+			AtlasEntry& entry = entries[i];
+			SDL_Surface* surface = surfaces[entry.page];
+			if (surface)
+			{
+				// copy the alpha as it is instead of blending it onto the page
+				SDL_SetSurfaceBlendMode(images[i], SDL_BLENDMODE_NONE);
+				SDL_BlitSurface(images[i], nullptr, surface, &entry.source);
+			}
+			SDL_FreeSurface(images[i]);
+			entry.uv = { (float)entry.source.x / widths[entry.page], (float)entry.source.y / heights[entry.page],
+				(float)entry.source.w / widths[entry.page], (float)entry.source.h / heights[entry.page] };
+		}
+		for (unsigned int i = 0; i < pages_count; ++i) Upload(i);
+	}
+
+	const AtlasEntry* Find(const char* path) const
+	{
+		for (unsigned int i = 0; i < entries_count; ++i)
+			if (!strcmp(entries[i].path, path)) return &entries[i];
+		return nullptr;
+	}
+
+	// Takes a reference to the page holding path and returns its index, with
+	// the sprite's rects. An empty or unknown path gets the solid block on
+	// page 0 and no texture. Returns -1 if there is no page at all.
+	int Acquire(const char* path, SDL_Texture*& texture, SDL_Rect& source, SDL_FRect& uv)
+	{
+		const AtlasEntry* entry = Find(path);
+		const unsigned int page = entry ? entry->page : 0;
+		source = entry ? entry->source : SDL_Rect{ 0, 0, 0, 0 };
+		uv = entry ? entry->uv : solid_uv;
+		texture = nullptr;
+		if (page >= pages_count) return -1;
+
+		++references[page];
+		idle[page] = 0;
+		if (!pages[page]) Upload(page);
+		if (entry) texture = pages[page];
+		return page;
+	}
+
+	void Release(int page)
+	{
+		if (page >= 0) --references[page];
+	}
+
+	// Called once a frame: frees the textures of pages no emitter has used
+	// for evict_frames frames.
+	void Age()
+	{
+		for (unsigned int i = 0; i < pages_count; ++i)
+			if (references[i] == 0 && pages[i] && ++idle[i] > evict_frames) Free(i);
+	}
+
+	// Frees the textures of every page no emitter uses, for when the system
+	// runs low on memory. Returns how many were freed.
+	unsigned int Evict()
+	{
+		unsigned int evicted = 0;
+		for (unsigned int i = 0; i < pages_count; ++i)
+			if (references[i] == 0 && pages[i])
+			{
+				Free(i);
+				++evicted;
+			}
+		return evicted;
+	}
+
+	// Resident pages, for the stats.
+	unsigned int Textures() const
+	{
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < pages_count; ++i) count += pages[i] != nullptr;
+		return count;
+	}
+
+	SDL_Texture* SolidPage() const
+	{
+		return pages_count ? pages[0] : nullptr;
+	}
+
+private:
+
+	void Free(unsigned int page)
+	{
+		SDL_DestroyTexture(pages[page]);
+		pages[page] = nullptr;
+		idle[page] = 0;
+	}
+
+	void Upload(unsigned int page)
+	{
+		if (!surfaces[page]) return;
+		pages[page] = SDL_CreateTextureFromSurface(renderer, surfaces[page]);
+		if (pages[page]) SDL_SetTextureBlendMode(pages[page], SDL_BLENDMODE_BLEND);
+		else printf("ERROR while creating particle atlas page %u: %s\n", page, SDL_GetError());
+	}
+
+};
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef _PARTICLEBUFFER_H_
+#define _PARTICLEBUFFER_H_
+
+#include <stdio.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <xmmintrin.h>
+
+#include "Pool.h"
+
+#define PARTICLE_ALIGNMENT 64
+#define PARTICLE_STREAMS 8
+// quantized positions count in 1/8 pixel steps
+#define PARTICLE_FIXED_ONE 8.0f
+// arenas are sized and aligned to 2 MB so the OS can back them with huge pages
+#define PARTICLE_ARENA_ALIGNMENT (2 * 1024 * 1024)
+
+// Particles are stored as one stream per attribute so the update pass only
+// pulls the attributes it integrates through the cache. Stream s starts at
+// block + s * stride, whether the buffer owns its memory or views an arena.
+struct ParticleBuffer
+{
+	unsigned int capacity;
+	// live particles are packed in [0, count)
+	unsigned int count;
+	unsigned int stride;
+	void* block;
+	bool owned;
+
+	float* lifetime;
+	float* lifespan;
+	float* x;
+	float* y;
+	float* vx;
+	float* vy;
+	float* w;
+	float* h;
+
+	ParticleBuffer()
+	{
+		capacity = count = stride = 0;
+		block = nullptr;
+		owned = false;
+		lifetime = lifespan = x = y = vx = vy = w = h = nullptr;
+	}
+
+	void Allocate(unsigned int _capacity, size_t alignment = PARTICLE_ALIGNMENT)
+	{
+		// every stream starts on its own cache line
+		const unsigned int floats_per_line = PARTICLE_ALIGNMENT / sizeof(float);
+		stride = (_capacity + floats_per_line - 1) / floats_per_line * floats_per_line;
+		size_t size = PARTICLE_STREAMS * stride * sizeof(float);
+		size = (size + alignment - 1) / alignment * alignment;
+		Attach(_mm_malloc(size, alignment), stride, _capacity);
+		owned = true;
+	}
+
+	// Views capacity particles of a larger buffer starting at offset.
+	void View(const ParticleBuffer& parent, unsigned int offset, unsigned int _capacity)
+	{
+		Attach(parent.lifetime + offset, parent.stride, _capacity);
+	}
+
+	void Attach(void* memory, unsigned int _stride, unsigned int _capacity)
+	{
+		capacity = _capacity;
+		count = 0;
+		stride = _stride;
+		block = memory;
+		owned = false;
+
+		float* stream = (float*)block;
+		lifetime = stream; stream += stride;
+		lifespan = stream; stream += stride;
+		x = stream; stream += stride;
+		y = stream; stream += stride;
+		vx = stream; stream += stride;
+		vy = stream; stream += stride;
+		w = stream; stream += stride;
+		h = stream;
+	}
+
+	void Free()
+	{
+		if (owned) _mm_free(block);
+		block = nullptr;
+		owned = false;
+		lifetime = lifespan = x = y = vx = vy = w = h = nullptr;
+		capacity = count = stride = 0;
+	}
+
+	void Move(unsigned int from, unsigned int to)
+	{
+		lifetime[to] = lifetime[from];
+		lifespan[to] = lifespan[from];
+		x[to] = x[from];
+		y[to] = y[from];
+		vx[to] = vx[from];
+		vy[to] = vy[from];
+		w[to] = w[from];
+		h[to] = h[from];
+	}
+
+	// Swap-removes expired particles so the live ones stay packed.
+	void Compact()
+	{
+		for (unsigned int i = 0; i < count;)
+			if (lifetime[i] >= lifespan[i]) Move(--count, i);
+			else ++i;
+	}
+};
+
+// IEEE half floats, rounded to nearest even like the F16C instructions.
+inline uint16_t FloatToHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const uint16_t sign = (bits >> 16) & 0x8000;
+	bits &= 0x7FFFFFFF;
+
+	if (bits >= 0x7F800000) return sign | 0x7C00 | (bits > 0x7F800000 ? 0x200 | ((bits >> 13) & 0x3FF) : 0);
+	if (bits < 0x33000000) return sign;
+
+	unsigned int exponent = bits >> 23;
+	uint32_t mantissa = (bits & 0x7FFFFF) | 0x800000;
+	uint32_t result, rest, halfway;
+	if (exponent < 113)
+	{
+		// subnormal: the implicit bit shifts into the mantissa
+		const unsigned int shift = 126 - exponent;
+		result = mantissa >> shift;
+		rest = mantissa & ((1u << shift) - 1);
+		halfway = 1u << (shift - 1);
+	}
+	else
+	{
+		result = ((exponent - 112) << 10) | ((mantissa >> 13) & 0x3FF);
+		rest = mantissa & 0x1FFF;
+		halfway = 0x1000;
+	}
+	// a carry out of the mantissa bumps the exponent, up to infinity
+	if (rest > halfway || (rest == halfway && (result & 1))) ++result;
+	return sign | (result > 0x7C00 ? 0x7C00 : result);
+}
+
+inline float HalfToFloat(uint16_t half)
+{
+	const uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	const uint32_t exponent = (half >> 10) & 0x1F, mantissa = half & 0x3FF;
+	uint32_t bits;
+	if (exponent == 0)
+	{
+		const float value = mantissa * (1.0f / 16777216.0f);
+		memcpy(&bits, &value, sizeof(bits));
+		bits |= sign;
+	}
+	else if (exponent == 31) bits = sign | 0x7F800000 | (mantissa << 13);
+	else bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline int16_t FloatToFixed(float value)
+{
+	const float fixed = value * PARTICLE_FIXED_ONE;
+	return fixed <= -32768.0f ? -32768 : (fixed >= 32767.0f ? 32767 : (int16_t)lrintf(fixed));
+}
+
+// Compact particle layout, 16 bytes a particle instead of 32: positions are
+// 16-bit fixed point relative to the emitter center, velocities and sizes are
+// half floats and lifetimes count whole steps. It is laid over a ParticleBuffer
+// of half the capacity, each 16-bit stream taking half a float stream's room,
+// so quantized emitters come from the same pool and arena as the rest.
+struct QuantizedParticles
+{
+	uint16_t* lifetime;
+	uint16_t* lifespan;
+	int16_t* x;
+	int16_t* y;
+	uint16_t* vx;
+	uint16_t* vy;
+	uint16_t* w;
+	uint16_t* h;
+
+	QuantizedParticles(const ParticleBuffer& storage)
+	{
+		const unsigned int stride = storage.stride * 2;
+		uint16_t* stream = (uint16_t*)storage.block;
+		lifetime = stream; stream += stride;
+		lifespan = stream; stream += stride;
+		x = (int16_t*)stream; stream += stride;
+		y = (int16_t*)stream; stream += stride;
+		vx = stream; stream += stride;
+		vy = stream; stream += stride;
+		w = stream; stream += stride;
+		h = stream;
+	}
+
+	// capacity of the float buffer that holds count quantized particles
+	static unsigned int StorageCapacity(unsigned int count)
+	{
+		return (count + 1) / 2;
+	}
+
+	void Move(unsigned int from, unsigned int to)
+	{
+		lifetime[to] = lifetime[from];
+		lifespan[to] = lifespan[from];
+		x[to] = x[from];
+		y[to] = y[from];
+		vx[to] = vx[from];
+		vy[to] = vy[from];
+		w[to] = w[from];
+		h[to] = h[from];
+	}
+
+	void Compact(unsigned int& count)
+	{
+		for (unsigned int i = 0; i < count;)
+			if (lifetime[i] >= lifespan[i]) Move(--count, i);
+			else ++i;
+	}
+};
+
+// Every emitter's particle ranges are carved out of one arena: they share the
+// arena's stream stride and a reset drops them all at once, without freeing
+// each one. The ranges are not packed: each is rounded up to its pool bucket,
+// retired ranges wait in the pool and heap fallbacks live elsewhere, so the
+// live particles are not one contiguous run. Updates still go emitter by
+// emitter, each with its own forces, kernel and storage format.
+class ParticleArena
+{
+public:
+
+	ParticleBuffer streams;
+	unsigned int used;
+
+	ParticleArena()
+	{
+		used = 0;
+	}
+
+	~ParticleArena()
+	{
+		streams.Free();
+	}
+
+	void Init(unsigned int capacity)
+	{
+		streams.Allocate(capacity, PARTICLE_ARENA_ALIGNMENT);
+		used = 0;
+	}
+
+	bool Carve(ParticleBuffer& buffer, unsigned int capacity)
+	{
+		if (streams.capacity - used < capacity) return false;
+		buffer.View(streams, used, capacity);
+		used += capacity;
+		return true;
+	}
+
+	void Reset()
+	{
+		used = 0;
+	}
+};
+
+#define PARTICLE_BUCKETS 32
+
+// Recycles particle buffers in power-of-two capacity buckets, so a retired
+// emitter's range is handed to the next emitter of similar size. New ranges
+// come from the arena, or from the heap once the arena is full.
+class ParticleBufferPool
+{
+public:
+
+	ParticleArena* arena;
+	Pool<ParticleBuffer> buckets[PARTICLE_BUCKETS];
+
+	ParticleBufferPool()
+	{
+		arena = nullptr;
+	}
+
+	~ParticleBufferPool()
+	{
+		Clear();
+	}
+
+	void Acquire(ParticleBuffer& buffer, unsigned int capacity)
+	{
+		unsigned int bucket = 0;
+		unsigned int bucket_capacity = PARTICLE_ALIGNMENT / sizeof(float);
+		while (bucket_capacity < capacity)
+		{
+			bucket_capacity <<= 1;
+			++bucket;
+		}
+
+		if (buckets[bucket].Get(buffer)) buffer.count = 0;
+		else if (!arena->Carve(buffer, bucket_capacity))
+		{
+			printf("ERROR particle arena is full, allocating %u particles on the heap\n", bucket_capacity);
+			buffer.Allocate(bucket_capacity);
+		}
+	}
+
+	void Release(ParticleBuffer& buffer)
+	{
+		if (!buffer.block) return;
+
+		unsigned int bucket = 0;
+		unsigned int bucket_capacity = PARTICLE_ALIGNMENT / sizeof(float);
+		while (bucket_capacity < buffer.capacity)
+		{
+			bucket_capacity <<= 1;
+			++bucket;
+		}
+
+		buckets[bucket].Put(buffer);
+		buffer = ParticleBuffer();
+	}
+
+	// Forgets every pooled range; only heap fallbacks need freeing.
+	void Clear()
+	{
+		ParticleBuffer buffer;
+		for (int i = 0; i < PARTICLE_BUCKETS; ++i)
+			while (buckets[i].Get(buffer)) buffer.Free();
+	}
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef _PARTICLEGEOMETRY_H_
+#define _PARTICLEGEOMETRY_H_
+
+#include <string.h>
+
+#include "SDL.h"
+
+// SDL_RenderGeometry arrived in SDL 2.0.18. It is looked up at run time, so a
+// build against older headers still batches quads once the SDL2 library it
+// runs with has it; otherwise textured particles are drawn one SDL_RenderCopy
+// at a time and untextured ones as batched rects.
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+typedef SDL_Vertex ParticleVertex;
+#else
+// laid out like SDL_Vertex
+struct ParticleVertex
+{
+	SDL_FPoint position;
+	SDL_Color color;
+	SDL_FPoint tex_coord;
+};
+#endif
+
+#if defined(_WIN32)
+#define PARTICLE_SDL_LIBRARY "SDL2.dll"
+#elif defined(__APPLE__)
+#define PARTICLE_SDL_LIBRARY "libSDL2-2.0.0.dylib"
+#else
+#define PARTICLE_SDL_LIBRARY "libSDL2-2.0.so.0"
+#endif
+
+typedef int (SDLCALL* RenderGeometryFunction)(SDL_Renderer* renderer, SDL_Texture* texture, const ParticleVertex* vertices, int num_vertices, const int* indices, int num_indices);
+
+#define PARTICLE_ALPHA_LEVELS 32
+#define PARTICLE_LEVEL_RECTS 256
+
+// Shared by every emitter, which are drawn one after another.
+//
+// With SDL_RenderGeometry, quads wait to be sent in one call: emitters append
+// theirs and the batch is only submitted when the texture changes or the
+// frame is drawn, so emitters sharing an atlas page go out together. Four
+// vertices and six indices per particle; the index pattern never changes,
+// so it is only written on growth.
+//
+// Without it, untextured particles are rects sorted into PARTICLE_ALPHA_LEVELS
+// alpha levels, each drawn with one color change and one SDL_RenderFillRectsF
+// when it fills up or the emitter is done. Every particle is white, so
+// blending them in a different order gives the same picture.
+class ParticleGeometry
+{
+public:
+
+	RenderGeometryFunction render_geometry;
+	void* library;
+
+	ParticleVertex* vertices;
+	int* indices;
+	unsigned int capacity;
+	// quads waiting and the texture they are drawn with
+	unsigned int count;
+	SDL_Texture* texture;
+
+	SDL_FRect rects[PARTICLE_ALPHA_LEVELS][PARTICLE_LEVEL_RECTS];
+	unsigned int counts[PARTICLE_ALPHA_LEVELS];
+
+	ParticleGeometry()
+	{
+		render_geometry = nullptr;
+		library = nullptr;
+		vertices = nullptr;
+		indices = nullptr;
+		capacity = count = 0;
+		texture = nullptr;
+		memset(counts, 0, sizeof(counts));
+	}
+
+	~ParticleGeometry()
+	{
+		delete[] vertices;
+		delete[] indices;
+		if (library) SDL_UnloadObject(library);
+	}
+
+	// Finds SDL_RenderGeometry in the SDL2 library in use, if it has it.
+	void Load()
+	{
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+		render_geometry = SDL_RenderGeometry;
+#else
+		SDL_version linked;
+		SDL_GetVersion(&linked);
+		if (SDL_VERSIONNUM(linked.major, linked.minor, linked.patch) < SDL_VERSIONNUM(2, 0, 18)) return;
+		library = SDL_LoadObject(PARTICLE_SDL_LIBRARY);
+		if (library) render_geometry = (RenderGeometryFunction)SDL_LoadFunction(library, "SDL_RenderGeometry");
+#endif
+	}
+
+	bool Batched() const
+	{
+		return render_geometry != nullptr;
+	}
+
+	// Makes room for quads more quads drawn with _texture, submitting the
+	// waiting ones first if they use another texture. The new quads go from
+	// vertices + count * 4 on; the caller adds them to count once written.
+	void Begin(SDL_Renderer* renderer, SDL_Texture* _texture, unsigned int quads)
+	{
+		if (_texture != texture) Flush(renderer);
+		texture = _texture;
+		Reserve(count + quads);
+	}
+
+	void Add(SDL_Renderer* renderer, const SDL_FRect& rect, Uint8 alpha)
+	{
+		const unsigned int level = alpha * PARTICLE_ALPHA_LEVELS / 256;
+		rects[level][counts[level]++] = rect;
+		if (counts[level] == PARTICLE_LEVEL_RECTS) Flush(renderer, level);
+	}
+
+	void Flush(SDL_Renderer* renderer)
+	{
+		if (count) render_geometry(renderer, texture, vertices, count * 4, indices, count * 6);
+		count = 0;
+		for (unsigned int level = 0; level < PARTICLE_ALPHA_LEVELS; ++level)
+			if (counts[level]) Flush(renderer, level);
+	}
+
+private:
+
+	void Flush(SDL_Renderer* renderer, unsigned int level)
+	{
+		// each level is drawn with the alpha in its middle
+		SDL_SetRenderDrawColor(renderer, 255, 255, 255, (level * 256 + 128) / PARTICLE_ALPHA_LEVELS);
+		SDL_RenderFillRectsF(renderer, rects[level], counts[level]);
+		counts[level] = 0;
+	}
+
+	void Reserve(unsigned int quads)
+	{
+		if (quads <= capacity) return;
+
+		unsigned int _capacity = capacity ? capacity : 1024;
+		while (_capacity < quads) _capacity *= 2;
+		ParticleVertex* newVertices = new ParticleVertex[_capacity * 4];
+		if (count) memcpy(newVertices, vertices, count * 4 * sizeof(ParticleVertex));
+		delete[] vertices;
+		delete[] indices;
+		vertices = newVertices;
+		indices = new int[_capacity * 6];
+		for (unsigned int i = 0; i < _capacity; ++i)
+		{
+			const int corner = i * 4;
+			int* quad = indices + i * 6;
+			quad[0] = corner; quad[1] = corner + 1; quad[2] = corner + 2;
+			quad[3] = corner + 2; quad[4] = corner + 1; quad[5] = corner + 3;
+		}
+		capacity = _capacity;
+	}
+
+};
+
+#endif
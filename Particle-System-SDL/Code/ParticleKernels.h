@@ -0,0 +1,662 @@
+#ifndef _PARTICLEKERNELS_H_
+#define _PARTICLEKERNELS_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "SDL_cpuinfo.h"
+#include "SDL_stdinc.h"
+#include "ParticleBuffer.h"
+#include "ParticleGeometry.h"
+#include "Random.h"
+
+// Gravity steering pulls each velocity component towards the gravity center.
+// An update advances step steps at once, ax and ay already scaled by it; step
+// is a power of two so the scaled terms are exact and step 1 is a plain step.
+// It is at most PARTICLE_MAX_STEP, which quantized lifetimes leave room for.
+#define PARTICLE_MAX_STEP 64
+
+struct ParticleForces
+{
+	float center_x, center_y;
+	float ax, ay;
+	float step;
+};
+
+// Ranges new particles are drawn from, with the emitter position folded in.
+struct ParticleSpawn
+{
+	float min_lifespan, max_lifespan;
+	float min_x, max_x, min_y, max_y;
+	float min_vx, max_vx, min_vy, max_vy;
+	float min_w, max_w, min_h, max_h;
+};
+
+// Compile-time kernel features. Each kernel is instantiated for every
+// combination and the emitter picks the one its properties need, so an
+// emitter without gravity never runs the steering math.
+#define KERNEL_GRAVITY 1
+// looping emitters collect expired particles for respawning
+#define KERNEL_LOOP 2
+#define KERNEL_VARIANTS 4
+
+// Particles are updated in batches of at most this many so the expired index
+// list fits on the stack and the respawn pass finds the batch still in cache.
+#define RESPAWN_BATCH 256
+
+// The update kernels read state from in and write the stepped state to out;
+// in and out may be the same buffer. Expired particles are stepped like the
+// rest and their indices written, in order, to expired; the kernel returns how
+// many; without KERNEL_LOOP none are collected. A respawn kernel then
+// overwrites them in one pass. end - begin must not exceed RESPAWN_BATCH.
+//
+// Reference kernel: selects instead of branches, so the SIMD kernels can
+// reproduce it exactly lane by lane.
+template<unsigned int features>
+inline unsigned int UpdateParticlesScalar(const ParticleBuffer& in, ParticleBuffer& out, unsigned int begin, unsigned int end, const ParticleForces& f, unsigned int* expired)
+{
+	unsigned int count = 0;
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		if (features & KERNEL_LOOP)
+		{
+			expired[count] = i;
+			count += in.lifetime[i] >= in.lifespan[i];
+		}
+
+		if (&in != &out)
+		{
+			out.lifespan[i] = in.lifespan[i];
+			out.w[i] = in.w[i];
+			out.h[i] = in.h[i];
+			if (!(features & KERNEL_GRAVITY))
+			{
+				out.vx[i] = in.vx[i];
+				out.vy[i] = in.vy[i];
+			}
+		}
+
+		out.lifetime[i] = in.lifetime[i] + f.step;
+
+		const float vx = in.vx[i], vy = in.vy[i];
+		const float x = in.x[i] + vx * f.step;
+		const float y = in.y[i] + vy * f.step;
+		out.x[i] = x;
+		out.y[i] = y;
+		if (features & KERNEL_GRAVITY)
+		{
+			out.vx[i] = x < f.center_x ? vx + f.ax : (x > f.center_x ? vx - f.ax : vx);
+			out.vy[i] = y < f.center_y ? vy + f.ay : (y > f.center_y ? vy - f.ay : vy);
+		}
+	}
+	return count;
+}
+
+#if defined(_MSC_VER)
+#define PARTICLE_TARGET(isa)
+#define PARTICLE_POPCOUNT(x) __popcnt(x)
+#else
+#define PARTICLE_TARGET(isa) __attribute__((target(isa)))
+#define PARTICLE_POPCOUNT(x) __builtin_popcount(x)
+#endif
+
+// Appends the set bits of mask as indices starting at i.
+inline unsigned int CollectExpired(unsigned int mask, unsigned int i, unsigned int* expired, unsigned int count)
+{
+	for (; mask; ++i, mask >>= 1)
+	{
+		expired[count] = i;
+		count += mask & 1;
+	}
+	return count;
+}
+
+template<unsigned int features>
+PARTICLE_TARGET("sse4.1")
+inline unsigned int UpdateParticlesSSE41(const ParticleBuffer& in, ParticleBuffer& out, unsigned int begin, unsigned int end, const ParticleForces& f, unsigned int* expired)
+{
+	const __m128 step = _mm_set1_ps(f.step);
+	const __m128 center_x = _mm_set1_ps(f.center_x), center_y = _mm_set1_ps(f.center_y);
+	const __m128 ax = _mm_set1_ps(f.ax), ay = _mm_set1_ps(f.ay);
+
+	unsigned int count = 0;
+	unsigned int i = begin;
+	for (; i + 4 <= end; i += 4)
+	{
+		const __m128 lifetime = _mm_loadu_ps(in.lifetime + i), lifespan = _mm_loadu_ps(in.lifespan + i);
+		if (features & KERNEL_LOOP) count = CollectExpired(_mm_movemask_ps(_mm_cmpge_ps(lifetime, lifespan)), i, expired, count);
+
+		if (&in != &out)
+		{
+			_mm_storeu_ps(out.lifespan + i, lifespan);
+			_mm_storeu_ps(out.w + i, _mm_loadu_ps(in.w + i));
+			_mm_storeu_ps(out.h + i, _mm_loadu_ps(in.h + i));
+			if (!(features & KERNEL_GRAVITY))
+			{
+				_mm_storeu_ps(out.vx + i, _mm_loadu_ps(in.vx + i));
+				_mm_storeu_ps(out.vy + i, _mm_loadu_ps(in.vy + i));
+			}
+		}
+
+		_mm_storeu_ps(out.lifetime + i, _mm_add_ps(lifetime, step));
+
+		const __m128 vx = _mm_loadu_ps(in.vx + i), vy = _mm_loadu_ps(in.vy + i);
+		const __m128 x = _mm_add_ps(_mm_loadu_ps(in.x + i), _mm_mul_ps(vx, step));
+		const __m128 y = _mm_add_ps(_mm_loadu_ps(in.y + i), _mm_mul_ps(vy, step));
+		_mm_storeu_ps(out.x + i, x);
+		_mm_storeu_ps(out.y + i, y);
+		if (features & KERNEL_GRAVITY)
+		{
+			// blendv takes the second operand where the mask is set
+			const __m128 steer_x = _mm_blendv_ps(vx, _mm_sub_ps(vx, ax), _mm_cmpgt_ps(x, center_x));
+			const __m128 steer_y = _mm_blendv_ps(vy, _mm_sub_ps(vy, ay), _mm_cmpgt_ps(y, center_y));
+			_mm_storeu_ps(out.vx + i, _mm_blendv_ps(steer_x, _mm_add_ps(vx, ax), _mm_cmplt_ps(x, center_x)));
+			_mm_storeu_ps(out.vy + i, _mm_blendv_ps(steer_y, _mm_add_ps(vy, ay), _mm_cmplt_ps(y, center_y)));
+		}
+	}
+	return count + UpdateParticlesScalar<features>(in, out, i, end, f, expired + count);
+}
+
+template<unsigned int features>
+PARTICLE_TARGET("avx2")
+inline unsigned int UpdateParticlesAVX2(const ParticleBuffer& in, ParticleBuffer& out, unsigned int begin, unsigned int end, const ParticleForces& f, unsigned int* expired)
+{
+	const __m256 step = _mm256_set1_ps(f.step);
+	const __m256 center_x = _mm256_set1_ps(f.center_x), center_y = _mm256_set1_ps(f.center_y);
+	const __m256 ax = _mm256_set1_ps(f.ax), ay = _mm256_set1_ps(f.ay);
+
+	unsigned int count = 0;
+	unsigned int i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		const __m256 lifetime = _mm256_loadu_ps(in.lifetime + i), lifespan = _mm256_loadu_ps(in.lifespan + i);
+		if (features & KERNEL_LOOP) count = CollectExpired(_mm256_movemask_ps(_mm256_cmp_ps(lifetime, lifespan, _CMP_GE_OQ)), i, expired, count);
+
+		if (&in != &out)
+		{
+			_mm256_storeu_ps(out.lifespan + i, lifespan);
+			_mm256_storeu_ps(out.w + i, _mm256_loadu_ps(in.w + i));
+			_mm256_storeu_ps(out.h + i, _mm256_loadu_ps(in.h + i));
+			if (!(features & KERNEL_GRAVITY))
+			{
+				_mm256_storeu_ps(out.vx + i, _mm256_loadu_ps(in.vx + i));
+				_mm256_storeu_ps(out.vy + i, _mm256_loadu_ps(in.vy + i));
+			}
+		}
+
+		_mm256_storeu_ps(out.lifetime + i, _mm256_add_ps(lifetime, step));
+
+		const __m256 vx = _mm256_loadu_ps(in.vx + i), vy = _mm256_loadu_ps(in.vy + i);
+		const __m256 x = _mm256_add_ps(_mm256_loadu_ps(in.x + i), _mm256_mul_ps(vx, step));
+		const __m256 y = _mm256_add_ps(_mm256_loadu_ps(in.y + i), _mm256_mul_ps(vy, step));
+		_mm256_storeu_ps(out.x + i, x);
+		_mm256_storeu_ps(out.y + i, y);
+		if (features & KERNEL_GRAVITY)
+		{
+			const __m256 steer_x = _mm256_blendv_ps(vx, _mm256_sub_ps(vx, ax), _mm256_cmp_ps(x, center_x, _CMP_GT_OQ));
+			const __m256 steer_y = _mm256_blendv_ps(vy, _mm256_sub_ps(vy, ay), _mm256_cmp_ps(y, center_y, _CMP_GT_OQ));
+			_mm256_storeu_ps(out.vx + i, _mm256_blendv_ps(steer_x, _mm256_add_ps(vx, ax), _mm256_cmp_ps(x, center_x, _CMP_LT_OQ)));
+			_mm256_storeu_ps(out.vy + i, _mm256_blendv_ps(steer_y, _mm256_add_ps(vy, ay), _mm256_cmp_ps(y, center_y, _CMP_LT_OQ)));
+		}
+	}
+	return count + UpdateParticlesScalar<features>(in, out, i, end, f, expired + count);
+}
+
+template<unsigned int features>
+PARTICLE_TARGET("avx512f")
+inline unsigned int UpdateParticlesAVX512(const ParticleBuffer& in, ParticleBuffer& out, unsigned int begin, unsigned int end, const ParticleForces& f, unsigned int* expired)
+{
+	const __m512 step = _mm512_set1_ps(f.step);
+	const __m512 center_x = _mm512_set1_ps(f.center_x), center_y = _mm512_set1_ps(f.center_y);
+	const __m512 ax = _mm512_set1_ps(f.ax), ay = _mm512_set1_ps(f.ay);
+	const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+	unsigned int count = 0;
+	unsigned int i = begin;
+	for (; i + 16 <= end; i += 16)
+	{
+		const __m512 lifetime = _mm512_loadu_ps(in.lifetime + i), lifespan = _mm512_loadu_ps(in.lifespan + i);
+		if (features & KERNEL_LOOP)
+		{
+			// compress packs the expired lane indices to the front, keeping their order
+			const __mmask16 mask = _mm512_cmp_ps_mask(lifetime, lifespan, _CMP_GE_OQ);
+			_mm512_mask_compressstoreu_epi32(expired + count, mask, _mm512_add_epi32(lanes, _mm512_set1_epi32(i)));
+			count += PARTICLE_POPCOUNT(mask);
+		}
+
+		if (&in != &out)
+		{
+			_mm512_storeu_ps(out.lifespan + i, lifespan);
+			_mm512_storeu_ps(out.w + i, _mm512_loadu_ps(in.w + i));
+			_mm512_storeu_ps(out.h + i, _mm512_loadu_ps(in.h + i));
+			if (!(features & KERNEL_GRAVITY))
+			{
+				_mm512_storeu_ps(out.vx + i, _mm512_loadu_ps(in.vx + i));
+				_mm512_storeu_ps(out.vy + i, _mm512_loadu_ps(in.vy + i));
+			}
+		}
+
+		_mm512_storeu_ps(out.lifetime + i, _mm512_add_ps(lifetime, step));
+
+		const __m512 vx = _mm512_loadu_ps(in.vx + i), vy = _mm512_loadu_ps(in.vy + i);
+		const __m512 x = _mm512_add_ps(_mm512_loadu_ps(in.x + i), _mm512_mul_ps(vx, step));
+		const __m512 y = _mm512_add_ps(_mm512_loadu_ps(in.y + i), _mm512_mul_ps(vy, step));
+		_mm512_storeu_ps(out.x + i, x);
+		_mm512_storeu_ps(out.y + i, y);
+		if (features & KERNEL_GRAVITY)
+		{
+			const __m512 steer_x = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, center_x, _CMP_GT_OQ), vx, _mm512_sub_ps(vx, ax));
+			const __m512 steer_y = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(y, center_y, _CMP_GT_OQ), vy, _mm512_sub_ps(vy, ay));
+			_mm512_storeu_ps(out.vx + i, _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, center_x, _CMP_LT_OQ), steer_x, _mm512_add_ps(vx, ax)));
+			_mm512_storeu_ps(out.vy + i, _mm512_mask_blend_ps(_mm512_cmp_ps_mask(y, center_y, _CMP_LT_OQ), steer_y, _mm512_add_ps(vy, ay)));
+		}
+	}
+	return count + UpdateParticlesScalar<features>(in, out, i, end, f, expired + count);
+}
+
+typedef unsigned int (*UpdateFunction)(const ParticleBuffer& in, ParticleBuffer& out, unsigned int begin, unsigned int end, const ParticleForces& f, unsigned int* expired);
+
+// The respawn kernels give the count particles listed in indices a fresh
+// start. Every stream is drawn for the whole batch with Random::Fill and then
+// scattered, so the random sequence is the same whichever kernel runs.
+typedef void (*RespawnFunction)(ParticleBuffer& p, const unsigned int* indices, unsigned int count, const ParticleSpawn& s, Random& r);
+
+inline void ScatterScalar(float* stream, const unsigned int* indices, const float* values, unsigned int count)
+{
+	for (unsigned int k = 0; k < count; ++k) stream[indices[k]] = values[k];
+}
+
+PARTICLE_TARGET("avx512f")
+inline void ScatterAVX512(float* stream, const unsigned int* indices, const float* values, unsigned int count)
+{
+	unsigned int k = 0;
+	for (; k + 16 <= count; k += 16)
+		_mm512_i32scatter_ps(stream, _mm512_loadu_si512(indices + k), _mm512_loadu_ps(values + k), 4);
+	ScatterScalar(stream, indices + k, values + k, count - k);
+}
+
+// Only the scatter is ISA specific: Fill stays outside the target attribute,
+// where the compiler could otherwise fuse its multiply-add and change results.
+// Without sized, every particle gets min_w by min_h and no numbers are drawn
+// for the size.
+template<void (*scatter)(float*, const unsigned int*, const float*, unsigned int), bool sized>
+inline void RespawnParticles(ParticleBuffer& p, const unsigned int* indices, unsigned int count, const ParticleSpawn& s, Random& r)
+{
+	alignas(PARTICLE_ALIGNMENT) float values[RESPAWN_BATCH];
+	float* streams[] = { p.lifespan, p.x, p.y, p.vx, p.vy, p.w, p.h };
+	const float ranges[][2] = { { s.min_lifespan, s.max_lifespan }, { s.min_x, s.max_x }, { s.min_y, s.max_y },
+		{ s.min_vx, s.max_vx }, { s.min_vy, s.max_vy }, { s.min_w, s.max_w }, { s.min_h, s.max_h } };
+
+	memset(values, 0, count * sizeof(float));
+	scatter(p.lifetime, indices, values, count);
+	for (int stream = 0; stream < (sized ? 7 : 5); ++stream)
+	{
+		r.Fill(values, count, ranges[stream][0], ranges[stream][1]);
+		scatter(streams[stream], indices, values, count);
+	}
+	if (!sized)
+		for (int stream = 5; stream < 7; ++stream)
+		{
+			for (unsigned int k = 0; k < count; ++k) values[k] = ranges[stream][0];
+			scatter(streams[stream], indices, values, count);
+		}
+}
+
+// Quantized counterparts of the kernels above, over QuantizedParticles laid
+// on in and out. Positions move in fixed point and saturate at the edge of the
+// 16-bit range; forces and the spawn ranges are relative to the emitter center.
+inline int FixedCenter(float center)
+{
+	// one step past the int16 range compares the same as anything further out
+	const float fixed = center * PARTICLE_FIXED_ONE;
+	return fixed <= -32769.0f ? -32769 : (fixed >= 32768.0f ? 32768 : (int)lrintf(fixed));
+}
+
+template<unsigned int features>
+inline unsigned int UpdateQuantizedScalar(const ParticleBuffer& in, ParticleBuffer& out, unsigned int begin, unsigned int end, const ParticleForces& f, unsigned int* expired)
+{
+	const QuantizedParticles q_in(in), q_out(out);
+	const int center_x = FixedCenter(f.center_x), center_y = FixedCenter(f.center_y);
+	const float fixed_step = f.step * PARTICLE_FIXED_ONE;
+
+	unsigned int count = 0;
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		if (features & KERNEL_LOOP)
+		{
+			expired[count] = i;
+			count += q_in.lifetime[i] >= q_in.lifespan[i];
+		}
+
+		if (&in != &out)
+		{
+			q_out.lifespan[i] = q_in.lifespan[i];
+			q_out.w[i] = q_in.w[i];
+			q_out.h[i] = q_in.h[i];
+			if (!(features & KERNEL_GRAVITY))
+			{
+				q_out.vx[i] = q_in.vx[i];
+				q_out.vy[i] = q_in.vy[i];
+			}
+		}
+
+		q_out.lifetime[i] = q_in.lifetime[i] + (uint16_t)f.step;
+
+		const float vx = HalfToFloat(q_in.vx[i]), vy = HalfToFloat(q_in.vy[i]);
+		const int moved_x = q_in.x[i] + (int)lrintf(vx * fixed_step);
+		const int moved_y = q_in.y[i] + (int)lrintf(vy * fixed_step);
+		const int x = moved_x < -32768 ? -32768 : (moved_x > 32767 ? 32767 : moved_x);
+		const int y = moved_y < -32768 ? -32768 : (moved_y > 32767 ? 32767 : moved_y);
+		q_out.x[i] = x;
+		q_out.y[i] = y;
+		if (features & KERNEL_GRAVITY)
+		{
+			q_out.vx[i] = FloatToHalf(x < center_x ? vx + f.ax : (x > center_x ? vx - f.ax : vx));
+			q_out.vy[i] = FloatToHalf(y < center_y ? vy + f.ay : (y > center_y ? vy - f.ay : vy));
+		}
+	}
+	return count;
+}
+
+// Every CPU with AVX2 also has F16C, so this one serves the AVX2 and AVX-512 paths.
+template<unsigned int features>
+PARTICLE_TARGET("avx2,f16c")
+inline unsigned int UpdateQuantizedAVX2(const ParticleBuffer& in, ParticleBuffer& out, unsigned int begin, unsigned int end, const ParticleForces& f, unsigned int* expired)
+{
+	const QuantizedParticles q_in(in), q_out(out);
+	const __m128i step = _mm_set1_epi16((short)f.step);
+	const __m256i center_x = _mm256_set1_epi32(FixedCenter(f.center_x)), center_y = _mm256_set1_epi32(FixedCenter(f.center_y));
+	const __m256 fixed_step = _mm256_set1_ps(f.step * PARTICLE_FIXED_ONE);
+	const __m256 ax = _mm256_set1_ps(f.ax), ay = _mm256_set1_ps(f.ay);
+
+	unsigned int count = 0;
+	unsigned int i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		const __m128i lifetime = _mm_loadu_si128((const __m128i*)(q_in.lifetime + i));
+		const __m128i lifespan = _mm_loadu_si128((const __m128i*)(q_in.lifespan + i));
+		// unsigned lifetime >= lifespan, narrowed to one mask bit per particle
+		if (features & KERNEL_LOOP)
+		{
+			const __m128i expired_lanes = _mm_cmpeq_epi16(_mm_max_epu16(lifetime, lifespan), lifetime);
+			count = CollectExpired(_mm_movemask_epi8(_mm_packs_epi16(expired_lanes, _mm_setzero_si128())), i, expired, count);
+		}
+
+		if (&in != &out)
+		{
+			_mm_storeu_si128((__m128i*)(q_out.lifespan + i), lifespan);
+			_mm_storeu_si128((__m128i*)(q_out.w + i), _mm_loadu_si128((const __m128i*)(q_in.w + i)));
+			_mm_storeu_si128((__m128i*)(q_out.h + i), _mm_loadu_si128((const __m128i*)(q_in.h + i)));
+			if (!(features & KERNEL_GRAVITY))
+			{
+				_mm_storeu_si128((__m128i*)(q_out.vx + i), _mm_loadu_si128((const __m128i*)(q_in.vx + i)));
+				_mm_storeu_si128((__m128i*)(q_out.vy + i), _mm_loadu_si128((const __m128i*)(q_in.vy + i)));
+			}
+		}
+
+		_mm_storeu_si128((__m128i*)(q_out.lifetime + i), _mm_add_epi16(lifetime, step));
+
+		const __m256 vx = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(q_in.vx + i)));
+		const __m256 vy = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(q_in.vy + i)));
+		const __m256i moved_x = _mm256_add_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(q_in.x + i))), _mm256_cvtps_epi32(_mm256_mul_ps(vx, fixed_step)));
+		const __m256i moved_y = _mm256_add_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(q_in.y + i))), _mm256_cvtps_epi32(_mm256_mul_ps(vy, fixed_step)));
+		// packs saturates to the int16 range
+		const __m128i packed_x = _mm_packs_epi32(_mm256_castsi256_si128(moved_x), _mm256_extracti128_si256(moved_x, 1));
+		const __m128i packed_y = _mm_packs_epi32(_mm256_castsi256_si128(moved_y), _mm256_extracti128_si256(moved_y, 1));
+		_mm_storeu_si128((__m128i*)(q_out.x + i), packed_x);
+		_mm_storeu_si128((__m128i*)(q_out.y + i), packed_y);
+
+		if (features & KERNEL_GRAVITY)
+		{
+			const __m256i x = _mm256_cvtepi16_epi32(packed_x), y = _mm256_cvtepi16_epi32(packed_y);
+			const __m256 steer_x = _mm256_blendv_ps(vx, _mm256_sub_ps(vx, ax), _mm256_castsi256_ps(_mm256_cmpgt_epi32(x, center_x)));
+			const __m256 steer_y = _mm256_blendv_ps(vy, _mm256_sub_ps(vy, ay), _mm256_castsi256_ps(_mm256_cmpgt_epi32(y, center_y)));
+			const __m256 new_vx = _mm256_blendv_ps(steer_x, _mm256_add_ps(vx, ax), _mm256_castsi256_ps(_mm256_cmpgt_epi32(center_x, x)));
+			const __m256 new_vy = _mm256_blendv_ps(steer_y, _mm256_add_ps(vy, ay), _mm256_castsi256_ps(_mm256_cmpgt_epi32(center_y, y)));
+			_mm_storeu_si128((__m128i*)(q_out.vx + i), _mm256_cvtps_ph(new_vx, _MM_FROUND_TO_NEAREST_INT));
+			_mm_storeu_si128((__m128i*)(q_out.vy + i), _mm256_cvtps_ph(new_vy, _MM_FROUND_TO_NEAREST_INT));
+		}
+	}
+	return count + UpdateQuantizedScalar<features>(in, out, i, end, f, expired + count);
+}
+
+template<bool sized>
+inline void RespawnQuantized(ParticleBuffer& p, const unsigned int* indices, unsigned int count, const ParticleSpawn& s, Random& r)
+{
+	const QuantizedParticles q(p);
+	alignas(PARTICLE_ALIGNMENT) float values[RESPAWN_BATCH];
+	uint16_t* halves[] = { q.vx, q.vy, q.w, q.h };
+	const float ranges[][2] = { { s.min_vx, s.max_vx }, { s.min_vy, s.max_vy }, { s.min_w, s.max_w }, { s.min_h, s.max_h } };
+
+	for (unsigned int k = 0; k < count; ++k) q.lifetime[indices[k]] = 0;
+	// a particle lives for whole steps, so the lifespan rounds up like the float
+	// kernels' lifetime >= lifespan test does; an update adds up to
+	// PARTICLE_MAX_STEP to a lifetime still under the lifespan, so the cap
+	// keeps that sum in range
+	r.Fill(values, count, s.min_lifespan, s.max_lifespan);
+	for (unsigned int k = 0; k < count; ++k) q.lifespan[indices[k]] = (uint16_t)SDL_min(SDL_max(ceilf(values[k]), 0.0f), 65535.0f - PARTICLE_MAX_STEP);
+	r.Fill(values, count, s.min_x, s.max_x);
+	for (unsigned int k = 0; k < count; ++k) q.x[indices[k]] = FloatToFixed(values[k]);
+	r.Fill(values, count, s.min_y, s.max_y);
+	for (unsigned int k = 0; k < count; ++k) q.y[indices[k]] = FloatToFixed(values[k]);
+	for (int stream = 0; stream < (sized ? 4 : 2); ++stream)
+	{
+		r.Fill(values, count, ranges[stream][0], ranges[stream][1]);
+		for (unsigned int k = 0; k < count; ++k) halves[stream][indices[k]] = FloatToHalf(values[k]);
+	}
+	if (!sized)
+		for (int stream = 2; stream < 4; ++stream)
+		{
+			const uint16_t size = FloatToHalf(ranges[stream][0]);
+			for (unsigned int k = 0; k < count; ++k) halves[stream][indices[k]] = size;
+		}
+}
+
+// particles Draw expands from quantized or stateless emitters at a time
+#define DECODE_BATCH 256
+
+// Expands quantized particles [begin, end) into out starting at 0, placing
+// them back around origin.
+inline void DecodeQuantized(const ParticleBuffer& in, unsigned int begin, unsigned int end, float origin_x, float origin_y, ParticleBuffer& out)
+{
+	const QuantizedParticles q(in);
+	for (unsigned int i = begin, o = 0; i < end; ++i, ++o)
+	{
+		out.lifetime[o] = q.lifetime[i];
+		out.lifespan[o] = q.lifespan[i];
+		out.x[o] = origin_x + q.x[i] * (1.0f / PARTICLE_FIXED_ONE);
+		out.y[o] = origin_y + q.y[i] * (1.0f / PARTICLE_FIXED_ONE);
+		out.vx[o] = HalfToFloat(q.vx[i]);
+		out.vy[o] = HalfToFloat(q.vy[i]);
+		out.w[o] = HalfToFloat(q.w[i]);
+		out.h[o] = HalfToFloat(q.h[i]);
+	}
+}
+
+// Stateless particles are never stored. Slot i keeps one lifespan, hashed from
+// (seed, i), and is reborn every ceil(lifespan) + 1 steps, the same cycle a
+// stored looping particle goes through; each rebirth hashes its start from
+// (seed, i, generation). With no forces the state at any step is closed form,
+// what the update kernels would integrate up to rounding. Writes slots
+// [begin, end) at clock steps into out starting at 0.
+inline void EvaluateStateless(const ParticleSpawn& s, uint64_t seed, unsigned int clock, unsigned int begin, unsigned int end, ParticleBuffer& out)
+{
+	for (unsigned int i = begin, o = 0; i < end; ++i, ++o)
+	{
+		const uint64_t slot = Random::Mix(seed ^ i);
+		const float lifespan = Random::Uniform((uint32_t)(slot >> 32), s.min_lifespan, s.max_lifespan);
+		const unsigned int period = (unsigned int)ceilf(lifespan) + 1;
+		uint64_t state = Random::Mix(slot ^ (clock / period));
+		const float age = (float)(clock % period);
+
+		const float vx = Random::Uniform(Random::SplitMix(state), s.min_vx, s.max_vx);
+		const float vy = Random::Uniform(Random::SplitMix(state), s.min_vy, s.max_vy);
+		out.lifetime[o] = age;
+		out.lifespan[o] = lifespan;
+		out.x[o] = Random::Uniform(Random::SplitMix(state), s.min_x, s.max_x) + vx * age;
+		out.y[o] = Random::Uniform(Random::SplitMix(state), s.min_y, s.max_y) + vy * age;
+		out.vx[o] = vx;
+		out.vy[o] = vy;
+		out.w[o] = Random::Uniform(Random::SplitMix(state), s.min_w, s.max_w);
+		out.h[o] = Random::Uniform(Random::SplitMix(state), s.min_h, s.max_h);
+	}
+}
+
+// Where Draw puts particles: the camera offset, how far past the simulated
+// state to extrapolate, how much to grow each particle and the sprite's
+// texture coordinates.
+struct ParticleView
+{
+	float camerax, cameray;
+	float interpolation;
+	float grow;
+	SDL_FRect uv;
+};
+
+// The vertex kernels write count particles as four vertices each, corners in
+// the order ParticleGeometry indexes them, with the fade in the vertex alpha.
+typedef void (*QuadsFunction)(const ParticleBuffer& p, unsigned int count, const ParticleView& v, ParticleVertex* quads);
+
+inline void WriteQuad(ParticleVertex* quad, float left, float top, float right, float bottom, Uint8 alpha, const SDL_FRect& uv)
+{
+	quad[0] = { { left, top }, { 255, 255, 255, alpha }, { uv.x, uv.y } };
+	quad[1] = { { right, top }, { 255, 255, 255, alpha }, { uv.x + uv.w, uv.y } };
+	quad[2] = { { left, bottom }, { 255, 255, 255, alpha }, { uv.x, uv.y + uv.h } };
+	quad[3] = { { right, bottom }, { 255, 255, 255, alpha }, { uv.x + uv.w, uv.y + uv.h } };
+}
+
+inline void BuildQuadsScalar(const ParticleBuffer& p, unsigned int count, const ParticleView& v, ParticleVertex* quads)
+{
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		const float x = p.x[i] + p.vx[i] * v.interpolation;
+		const float y = p.y[i] + p.vy[i] * v.interpolation;
+		const float w = p.w[i] * v.grow, h = p.h[i] * v.grow;
+		const float lifetime = SDL_min(p.lifetime[i] + v.interpolation, p.lifespan[i]);
+		const Uint8 alpha = (Uint8)(int)(255 * (1 - (lifetime / p.lifespan[i])));
+		const float left = v.camerax + x - w / 2, top = v.cameray + y - h / 2;
+		WriteQuad(quads + i * 4, left, top, left + w, top + h, alpha, v.uv);
+	}
+}
+
+// Eight particles' corners and alpha at a time; the interleaved vertices are
+// then written from the stack.
+PARTICLE_TARGET("avx2")
+inline void BuildQuadsAVX2(const ParticleBuffer& p, unsigned int count, const ParticleView& v, ParticleVertex* quads)
+{
+	const __m256 interpolation = _mm256_set1_ps(v.interpolation), grow = _mm256_set1_ps(v.grow);
+	const __m256 camerax = _mm256_set1_ps(v.camerax), cameray = _mm256_set1_ps(v.cameray);
+	const __m256 half = _mm256_set1_ps(0.5f), one = _mm256_set1_ps(1.0f), full = _mm256_set1_ps(255.0f);
+	alignas(32) float left[8], top[8], right[8], bottom[8];
+	alignas(32) int alpha[8];
+
+	unsigned int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256 x = _mm256_add_ps(_mm256_loadu_ps(p.x + i), _mm256_mul_ps(_mm256_loadu_ps(p.vx + i), interpolation));
+		const __m256 y = _mm256_add_ps(_mm256_loadu_ps(p.y + i), _mm256_mul_ps(_mm256_loadu_ps(p.vy + i), interpolation));
+		const __m256 w = _mm256_mul_ps(_mm256_loadu_ps(p.w + i), grow), h = _mm256_mul_ps(_mm256_loadu_ps(p.h + i), grow);
+		const __m256 lifespan = _mm256_loadu_ps(p.lifespan + i);
+		// min_ps(a, b) is a < b ? a : b, like SDL_min
+		const __m256 lifetime = _mm256_min_ps(_mm256_add_ps(_mm256_loadu_ps(p.lifetime + i), interpolation), lifespan);
+		const __m256 l = _mm256_sub_ps(_mm256_add_ps(camerax, x), _mm256_mul_ps(w, half));
+		const __m256 t = _mm256_sub_ps(_mm256_add_ps(cameray, y), _mm256_mul_ps(h, half));
+		_mm256_store_ps(left, l);
+		_mm256_store_ps(top, t);
+		_mm256_store_ps(right, _mm256_add_ps(l, w));
+		_mm256_store_ps(bottom, _mm256_add_ps(t, h));
+		_mm256_store_si256((__m256i*)alpha, _mm256_cvttps_epi32(_mm256_mul_ps(full, _mm256_sub_ps(one, _mm256_div_ps(lifetime, lifespan)))));
+		for (int k = 0; k < 8; ++k) WriteQuad(quads + (i + k) * 4, left[k], top[k], right[k], bottom[k], (Uint8)alpha[k], v.uv);
+	}
+	if (i < count)
+	{
+		ParticleBuffer rest;
+		rest.Attach(p.lifetime + i, p.stride, count - i);
+		BuildQuadsScalar(rest, count - i, v, quads + i * 4);
+	}
+}
+
+enum class KernelISA
+{
+	SCALAR,
+	SSE41,
+	AVX2,
+	AVX512,
+};
+
+// One entry per kernel, filled once for the best ISA the CPU supports.
+// update is indexed by KERNEL_* features, respawn by whether sizes vary.
+struct ParticleKernels
+{
+	KernelISA isa;
+	const char* name;
+	UpdateFunction update[KERNEL_VARIANTS];
+	UpdateFunction update_quantized[KERNEL_VARIANTS];
+	RespawnFunction respawn[2];
+	RespawnFunction respawn_quantized[2];
+	QuadsFunction build_quads;
+
+	// PARTICLES_KERNEL=scalar|sse41|avx2|avx512 forces a path for benchmarking
+	void Select()
+	{
+		KernelISA best = KernelISA::SCALAR;
+		if (SDL_HasSSE41()) best = KernelISA::SSE41;
+		if (SDL_HasAVX2()) best = KernelISA::AVX2;
+		if (SDL_HasAVX512F()) best = KernelISA::AVX512;
+
+		isa = best;
+		const char* forced = SDL_getenv("PARTICLES_KERNEL");
+		if (forced)
+		{
+			if (SDL_strcasecmp(forced, "scalar") == 0) isa = KernelISA::SCALAR;
+			else if (SDL_strcasecmp(forced, "sse41") == 0) isa = KernelISA::SSE41;
+			else if (SDL_strcasecmp(forced, "avx2") == 0) isa = KernelISA::AVX2;
+			else if (SDL_strcasecmp(forced, "avx512") == 0) isa = KernelISA::AVX512;
+			else printf("ERROR unknown particle kernel: %s\n", forced);
+
+			if (isa > best)
+			{
+				printf("ERROR particle kernel %s is not supported by this CPU\n", forced);
+				isa = best;
+			}
+		}
+
+		switch (isa)
+		{
+		case KernelISA::SCALAR: name = "scalar"; break;
+		case KernelISA::SSE41: name = "sse41"; break;
+		case KernelISA::AVX2: name = "avx2"; break;
+		case KernelISA::AVX512: name = "avx512"; break;
+		}
+
+		SelectFeatures<0>();
+		SelectFeatures<KERNEL_GRAVITY>();
+		SelectFeatures<KERNEL_LOOP>();
+		SelectFeatures<KERNEL_GRAVITY | KERNEL_LOOP>();
+
+		respawn[0] = isa == KernelISA::AVX512 ? RespawnParticles<ScatterAVX512, false> : RespawnParticles<ScatterScalar, false>;
+		respawn[1] = isa == KernelISA::AVX512 ? RespawnParticles<ScatterAVX512, true> : RespawnParticles<ScatterScalar, true>;
+		respawn_quantized[0] = RespawnQuantized<false>;
+		respawn_quantized[1] = RespawnQuantized<true>;
+		build_quads = isa >= KernelISA::AVX2 ? BuildQuadsAVX2 : BuildQuadsScalar;
+	}
+
+	template<unsigned int features>
+	void SelectFeatures()
+	{
+		switch (isa)
+		{
+		case KernelISA::SCALAR: update[features] = UpdateParticlesScalar<features>; break;
+		case KernelISA::SSE41: update[features] = UpdateParticlesSSE41<features>; break;
+		case KernelISA::AVX2: update[features] = UpdateParticlesAVX2<features>; break;
+		case KernelISA::AVX512: update[features] = UpdateParticlesAVX512<features>; break;
+		}
+		update_quantized[features] = isa >= KernelISA::AVX2 ? UpdateQuantizedAVX2<features> : UpdateQuantizedScalar<features>;
+	}
+};
+
+#endif
@@ -2,32 +2,76 @@
 #define _PARTICLESENGINE_H_
 
 #include <time.h>
+#include <algorithm>
+#include <utility>
 
 #include "SDL.h"
 #include "SDL_image.h"
 #include "SDL_ttf.h"
 #include "pugixml.hpp"
-#include "List.h"
+#include "SlotMap.h"
+#include "Random.h"
+#include "JobSystem.h"
+#include "ParticleAtlas.h"
+#include "ParticleGeometry.h"
+#include "ParticleKernels.h"
 
 #define RELEASE(x) { delete x; x = nullptr; }
 #define RELEASE_ARRAY(x) { delete[] x; x = nullptr; }
 
-struct Particle
-{
-	float lifetime, lifespan;
-	float x, y;
-	float vx, vy;
-	float w, h;
-};
-
 struct ParticleProperties
 {
 	unsigned int amount;
+	// the budget governor never keeps fewer particles than this
+	unsigned int min_amount;
+	// looping emitters respawn expired particles, the rest let them die
+	bool loop;
+	// store particles in the 16-byte QuantizedParticles layout
+	bool quantized;
+	// store nothing and evaluate particles in closed form; needs a looping
+	// emitter without gravity and takes precedence over quantized
+	bool stateless;
 	float min_lifespan, max_lifespan;
 	float min_vx, max_vx, min_vy, max_vy;
 	float gravity_center_x, gravity_center_y, gravity_ax, gravity_ay;
 	float min_x, max_x, min_y, max_y, min_w, max_w, min_h, max_h;
+	// atlas page of the sprite and where it sits on it, in pixels and in
+	// texture coordinates; untextured particles get the page's solid block
 	SDL_Texture* texture;
+	SDL_Rect source;
+	SDL_FRect uv;
+};
+
+// What the HUD and tools read about the system.
+struct ParticleStats
+{
+	unsigned int emitters;
+	unsigned int particles;
+	unsigned int sleeping;
+	// awake emitters not updated this frame, waiting for their turn
+	unsigned int deferred;
+	unsigned int latency_frames;
+	// atlas pages resident as textures
+	unsigned int textures;
+	// global particle density set by the budget governor, 1 is full quality
+	float density;
+	float update_ms;
+	float draw_ms;
+};
+
+// Engine-wide services shared by every emitter, owned by the ParticleSystem.
+struct ParticleContext
+{
+	SDL_Renderer* renderer;
+	const ParticleKernels* kernels;
+	JobSystem* jobs;
+	ParticleBufferPool* buffers;
+	ParticleAtlas* atlas;
+	ParticleGeometry* geometry;
+	// particles per parallel chunk, kept a multiple of the SIMD width
+	unsigned int parallel_chunk;
+	// simulate into a back buffer while the front one is drawn
+	bool pipelined;
 };
 
 enum class EmitterType
@@ -48,21 +92,74 @@ public:
 	int center_x, center_y;
 	EmitterType type;
 	ParticleProperties properties;
-	Particle* particles;
+	ParticleSpawn spawn;
+	ParticleBuffer particles;
+	ParticleBuffer back;
+	// back holds state newer than particles
+	bool stepped;
+	Random random;
+	const ParticleContext* context;
+
+	// stateless emitters: seed of the particle hashes, the step being drawn
+	// and the step simulated up to
+	uint64_t seed;
+	unsigned int clock;
+	unsigned int sim_clock;
+
+	// world rect no particle can leave, used to put off-screen emitters to sleep
+	SDL_FRect bounds;
+	bool asleep;
+	// steps missed while asleep
+	unsigned int slept;
+
+	// update scheduling: the emitter is stepped period steps at a time, at
+	// offset phase from the others; deferred steps are still to be simulated
+	// and updates is how many run this frame. Draw extrapolates velocities
+	// over the steps the drawn state lags behind; steer is the most a velocity
+	// changes in a step, which that extrapolation misses.
+	unsigned int period;
+	unsigned int phase;
+	unsigned int deferred;
+	unsigned int updates;
+	unsigned int lag;
+	unsigned int sim_lag;
+	float steer;
+
+	// level of detail: the fraction of particles kept; looping emitters only
+	// simulate and draw their first lod_count, bursts draw that fraction
+	unsigned int lod_count;
+	float detail;
+
+	// atlas page the emitter holds a reference to, -1 for none
+	int atlas_page;
+
+	// kernels specialized for this emitter's properties, picked in Init
+	UpdateFunction update_kernel;
+	RespawnFunction respawn_kernel;
+	// draws count particles of p, the first of which is particle first of the emitter
+	void (Emitter::*draw_particles)(SDL_Renderer* renderer, const ParticleBuffer& p, unsigned int first, unsigned int count, float camerax, float cameray, float interpolation, float grow, bool debugDraw);
 
 	Emitter()
 	{
 		active = false;
+		stepped = false;
+		atlas_page = -1;
 	}
 
-	~Emitter()
-	{
-		RELEASE_ARRAY(particles);
-	}
-
-	void Init(EmitterType _type, int _x, int _y, pugi::xml_node config, SDL_Renderer* renderer)
+	void Init(EmitterType _type, int _x, int _y, pugi::xml_node config, const ParticleContext* _context, uint64_t _seed)
 	{
 		active = true;
+		stepped = false;
+		asleep = false;
+		slept = 0;
+		period = 1;
+		phase = (unsigned int)_seed;
+		deferred = updates = lag = sim_lag = 0;
+		detail = 1.0f;
+		context = _context;
+		seed = _seed;
+		random.Seed(seed);
+		clock = sim_clock = 0;
 
 		type = _type;
 		center_x = _x;
@@ -79,6 +176,10 @@ public:
 		}
 
 		properties.amount = config.child("emitter").attribute("amount").as_int();
+		properties.min_amount = SDL_min(config.child("emitter").attribute("min_amount").as_uint(), properties.amount);
+		properties.loop = config.child("emitter").attribute("loop").as_bool(true);
+		properties.quantized = config.child("emitter").attribute("quantized").as_bool(false);
+		properties.stateless = config.child("emitter").attribute("stateless").as_bool(false);
 		properties.min_lifespan = config.child("lifespan").attribute("min").as_float();
 		properties.max_lifespan = config.child("lifespan").attribute("max").as_float();
 		properties.min_vx = config.child("velocity").attribute("min_vx").as_float();
@@ -97,76 +198,307 @@ public:
 		properties.max_w = config.child("draw").attribute("max_w").as_float();
 		properties.min_h = config.child("draw").attribute("min_h").as_float();
 		properties.max_h = config.child("draw").attribute("max_h").as_float();
+
+		const bool gravity = properties.gravity_ax != 0.0f || properties.gravity_ay != 0.0f;
+		if (properties.stateless && (gravity || !properties.loop))
+		{
+			printf("ERROR stateless particles need a looping emitter without gravity, storing them instead\n");
+			properties.stateless = false;
+		}
+		if (properties.stateless) properties.quantized = false;
+
+		// quantized positions are kept relative to the emitter center
+		const float origin_x = properties.quantized ? 0.0f : center_x, origin_y = properties.quantized ? 0.0f : center_y;
+		spawn = { properties.min_lifespan, properties.max_lifespan,
+			origin_x + properties.min_x, origin_x + properties.max_x, origin_y + properties.min_y, origin_y + properties.max_y,
+			properties.min_vx, properties.max_vx, properties.min_vy, properties.max_vy,
+			properties.min_w, properties.max_w, properties.min_h, properties.max_h };
+		// a particle drifts at most |v0| t + a t^2 / 2 from its spawn box
+		const float reach_time = ceilf(properties.max_lifespan) + 1.0f;
+		const float reach_x = SDL_max(fabsf(properties.min_vx), fabsf(properties.max_vx)) * reach_time + fabsf(properties.gravity_ax) * reach_time * reach_time / 2;
+		const float reach_y = SDL_max(fabsf(properties.min_vy), fabsf(properties.max_vy)) * reach_time + fabsf(properties.gravity_ay) * reach_time * reach_time / 2;
+		const float margin_x = reach_x + properties.max_w / 2, margin_y = reach_y + properties.max_h / 2;
+		steer = SDL_max(fabsf(properties.gravity_ax), fabsf(properties.gravity_ay));
+		bounds = { center_x + properties.min_x - margin_x, center_y + properties.min_y - margin_y,
+			properties.max_x - properties.min_x + 2 * margin_x, properties.max_y - properties.min_y + 2 * margin_y };
+
 		const char* texture_path = config.child("draw").attribute("texture").as_string();
-		properties.texture = IMG_LoadTexture(renderer, texture_path);
+		atlas_page = context->atlas->Acquire(texture_path, properties.texture, properties.source, properties.uv);
+
+		const bool sized = properties.min_w != properties.max_w || properties.min_h != properties.max_h;
+		const unsigned int features = (gravity ? KERNEL_GRAVITY : 0) | (properties.loop ? KERNEL_LOOP : 0);
+		update_kernel = properties.quantized ? context->kernels->update_quantized[features] : context->kernels->update[features];
+		respawn_kernel = properties.quantized ? context->kernels->respawn_quantized[sized] : context->kernels->respawn[sized];
+		if (context->geometry->Batched()) draw_particles = &Emitter::DrawQuads;
+		else draw_particles = properties.texture ? &Emitter::DrawCopies : &Emitter::DrawRects;
+
+		lod_count = properties.amount;
+		if (properties.stateless) return;
+
+		const unsigned int capacity = properties.quantized ? QuantizedParticles::StorageCapacity(properties.amount) : properties.amount;
+		context->buffers->Acquire(particles, capacity);
+		if (context->pipelined) context->buffers->Acquire(back, capacity);
+		context->jobs->ParallelFor(StartParticlesJob, this, &particles, 0, properties.amount, context->parallel_chunk);
+		particles.count = properties.amount;
+	}
 
-		particles = new Particle[properties.amount];
-		for (int i = 0; i < properties.amount; ++i)
-			particles[i] = StartParticle();
+	static void StartParticlesJob(void* emitter, void* buffer, unsigned int begin, unsigned int end)
+	{
+		Emitter* e = (Emitter*)emitter;
+		e->StartParticles(*(ParticleBuffer*)buffer, begin, end, e->RandomFor(begin, end, e->properties.amount));
 	}
 
-	Particle StartParticle()
+	// Passes over the whole emitter draw from its own generator, parallel
+	// chunks from the generator of the worker running them.
+	Random& RandomFor(unsigned int begin, unsigned int end, unsigned int count)
 	{
-		Particle p;
+		if (begin == 0 && end == count) return random;
+		return context->jobs->workers[JobSystem::WorkerIndex()].random;
+	}
 
-		p.lifetime = 0.0f;
-		p.lifespan = properties.min_lifespan + rand() % (int)(1 + properties.max_lifespan - properties.min_lifespan);
-		p.x = center_x + properties.min_x + rand() % (int)(1 + properties.max_x - properties.min_x);
-		p.y = center_y + properties.min_y + rand() % (int)(1 + properties.max_y - properties.min_y);
-		p.vx = properties.min_vx + rand() % (int)(1 + properties.max_vx - properties.min_vx);
-		p.vy = properties.min_vy + rand() % (int)(1 + properties.max_vy - properties.min_vy);
-		p.w = properties.min_w + rand() % (int)(1 + properties.max_w - properties.min_w);
-		p.h = properties.min_h + rand() % (int)(1 + properties.max_h - properties.min_h);
+	// Fills [begin, end) with new particles one stream at a time.
+	void StartParticles(ParticleBuffer& p, unsigned int begin, unsigned int end, Random& r)
+	{
+		if (properties.quantized)
+		{
+			// quantized particles only come out of the respawn kernel's encoding
+			unsigned int indices[RESPAWN_BATCH];
+			for (unsigned int i = begin; i < end; i += RESPAWN_BATCH)
+			{
+				const unsigned int n = SDL_min(end - i, RESPAWN_BATCH);
+				for (unsigned int k = 0; k < n; ++k) indices[k] = i + k;
+				respawn_kernel(p, indices, n, spawn, r);
+			}
+			return;
+		}
 
-		return p;
+		const unsigned int n = end - begin;
+		memset(p.lifetime + begin, 0, n * sizeof(float));
+		r.Fill(p.lifespan + begin, n, spawn.min_lifespan, spawn.max_lifespan);
+		r.Fill(p.x + begin, n, spawn.min_x, spawn.max_x);
+		r.Fill(p.y + begin, n, spawn.min_y, spawn.max_y);
+		r.Fill(p.vx + begin, n, spawn.min_vx, spawn.max_vx);
+		r.Fill(p.vy + begin, n, spawn.min_vy, spawn.max_vy);
+		if (spawn.min_w != spawn.max_w || spawn.min_h != spawn.max_h)
+		{
+			r.Fill(p.w + begin, n, spawn.min_w, spawn.max_w);
+			r.Fill(p.h + begin, n, spawn.min_h, spawn.max_h);
+		}
+		else
+		{
+			std::fill(p.w + begin, p.w + end, spawn.min_w);
+			std::fill(p.h + begin, p.h + end, spawn.min_h);
+		}
 	}
 
-	void Update(float dt)
+	// Advances span steps at once; span must be a power of two.
+	void Update(unsigned int span)
 	{
-		for (int i = 0; i < properties.amount; ++i)
+		if (properties.stateless)
 		{
-			if (particles[i].lifetime >= particles[i].lifespan)
-				particles[i] = StartParticle();
+			// there is nothing to step, only the clock moves
+			sim_clock += span;
+			stepped = context->pipelined;
+			if (!stepped) clock = sim_clock;
+			return;
+		}
 
-			++particles[i].lifetime;
+		ParticleForces forces{ properties.gravity_center_x, properties.gravity_center_y, properties.gravity_ax * span, properties.gravity_ay * span, (float)span };
+		if (properties.quantized)
+		{
+			forces.center_x -= center_x;
+			forces.center_y -= center_y;
+		}
+		const ParticleBuffer& in = stepped ? back : particles;
+		ParticleBuffer& out = back.block ? back : particles;
+		out.count = in.count;
+		context->jobs->ParallelFor(UpdateParticlesJob, this, &forces, 0, properties.loop ? lod_count : in.count, context->parallel_chunk);
+		// particles that just reached their lifespan are fully faded out, so they leave now
+		// instead of being respawned on the next step
+		if (!properties.loop)
+		{
+			if (properties.quantized) QuantizedParticles(out).Compact(out.count);
+			else out.Compact();
+		}
+		stepped = back.block != nullptr;
+	}
 
-			particles[i].x += particles[i].vx;
-			particles[i].y += particles[i].vy;
-			if (particles[i].x < properties.gravity_center_x) particles[i].vx += properties.gravity_ax;
-			if (particles[i].x > properties.gravity_center_x) particles[i].vx -= properties.gravity_ax;
-			if (particles[i].y < properties.gravity_center_y) particles[i].vy += properties.gravity_ay;
-			if (particles[i].y > properties.gravity_center_y) particles[i].vy -= properties.gravity_ay;
+	static void UpdateParticlesJob(void* emitter, void* forces, unsigned int begin, unsigned int end)
+	{
+		Emitter* e = (Emitter*)emitter;
+		// further steps in the same frame continue in the back buffer while the front one is drawn
+		const ParticleBuffer& in = e->stepped ? e->back : e->particles;
+		ParticleBuffer& out = e->back.block ? e->back : e->particles;
+		Random& random = e->RandomFor(begin, end, in.count);
+
+		// expired particles are gathered per batch and respawned together
+		unsigned int expired[RESPAWN_BATCH];
+		for (unsigned int i = begin; i < end; i += RESPAWN_BATCH)
+		{
+			const unsigned int count = e->update_kernel(in, out, i, SDL_min(i + RESPAWN_BATCH, end), *(ParticleForces*)forces, expired);
+			if (count) e->respawn_kernel(out, expired, count, e->spawn, random);
+		}
+	}
 
+	// Hands the particle memory back to the pool and drops the texture
+	// reference so the emitter can be reused.
+	void Release()
+	{
+		active = false;
+		context->buffers->Release(particles);
+		context->buffers->Release(back);
+		context->atlas->Release(atlas_page);
+		atlas_page = -1;
+	}
+
+	// Sends the emitter to sleep or wakes it up. Bursts are short lived and
+	// always simulated. On waking, stateless emitters just move their clock,
+	// short naps are replayed with the next update and longer ones re-seed.
+	void SetVisible(bool visible, unsigned int catch_up_steps)
+	{
+		if (!properties.loop) visible = true;
+		if (visible && asleep)
+		{
+			if (properties.stateless)
+			{
+				clock += slept;
+				sim_clock += slept;
+			}
+			else if (slept <= catch_up_steps) deferred += slept;
+			else
+			{
+				Reseed(0, lod_count);
+				deferred = 0;
+			}
+			slept = 0;
 		}
+		asleep = !visible;
 	}
 
-	void Draw(SDL_Renderer* renderer, float camerax, float cameray, bool debugDraw)
+	// Picks how many particles to keep from their projected size: particles
+	// smaller than min_size pixels across are thinned out by area, down to
+	// min_detail of them, and Draw grows the rest to cover the same area.
+	// density then scales the result, though never below min_amount.
+	// Particles coming back into use are re-seeded, their state being stale.
+	void SetDetail(float scale, float min_size, float min_detail, float density)
 	{
-		for (int i = 0; i < properties.amount; ++i)
+		const float size = sqrtf((properties.min_w + properties.max_w) * (properties.min_h + properties.max_h)) / 2 * scale;
+		detail = size >= min_size ? 1.0f : SDL_max(size * size / (min_size * min_size), min_detail);
+		if (properties.amount) detail = SDL_max(detail * density, (float)properties.min_amount / properties.amount);
+
+		// at least one particle, but never more than the emitter owns
+		const unsigned int wanted = SDL_min(SDL_max((unsigned int)ceilf(properties.amount * detail), 1u), properties.amount);
+		if (properties.loop && !properties.stateless && wanted > lod_count) Reseed(lod_count, wanted);
+		lod_count = wanted;
+	}
+
+	// Picks the update period: the longest power of two, from min_period (one
+	// simulated step) up to max_period, over which steering moves no particle
+	// more than max_motion pixels off the straight line Draw extrapolates,
+	// a t^2 / 2. Emitters only in the margin around the view take max_period.
+	// Bursts and stateless emitters cost nothing to defer or are short lived,
+	// so they step every time.
+	void SetPeriod(float scale, bool in_view, float max_motion, unsigned int min_period, unsigned int max_period)
+	{
+		period = min_period;
+		if (!properties.loop || properties.stateless) return;
+		if (!in_view) period = max_period;
+		else while (period * 2 <= max_period && steer * scale * (period * 2) * (period * 2) / 2 <= max_motion) period *= 2;
+	}
+
+	// Particles one update steps through.
+	unsigned int Load() const
+	{
+		return properties.stateless ? 0 : (properties.loop ? lod_count : particles.count);
+	}
+
+	// Statistical catch-up: a looping emitter that ran for a lifespan or more
+	// holds particles of every age, so [begin, end) is refilled with new
+	// particles aged at random. The aging ignores gravity.
+	void Reseed(unsigned int first, unsigned int last)
+	{
+		StartParticles(particles, first, last, random);
+		alignas(PARTICLE_ALIGNMENT) float ages[RESPAWN_BATCH];
+		for (unsigned int begin = first; begin < last; begin += RESPAWN_BATCH)
 		{
-			unsigned int alpha = 255 * (1 - (particles[i].lifetime / particles[i].lifespan));
-			SDL_Rect particleRect{ camerax + particles[i].x - particles[i].w / 2, cameray + particles[i].y - particles[i].h / 2, particles[i].w, particles[i].h };
-			if (properties.texture)
+			const unsigned int end = SDL_min(begin + RESPAWN_BATCH, last);
+			random.Fill(ages, end - begin, 0.0f, 1.0f);
+			if (properties.quantized)
 			{
-				SDL_SetTextureBlendMode(properties.texture, SDL_BLENDMODE_BLEND);
-				SDL_SetTextureAlphaMod(properties.texture, alpha);
-				SDL_RenderCopy(renderer, properties.texture, 0, &particleRect);
+				const QuantizedParticles q(particles);
+				for (unsigned int i = begin; i < end; ++i)
+				{
+					const unsigned int age = (unsigned int)(ages[i - begin] * q.lifespan[i]);
+					const int x = q.x[i] + (int)lrintf(HalfToFloat(q.vx[i]) * PARTICLE_FIXED_ONE) * (int)age;
+					const int y = q.y[i] + (int)lrintf(HalfToFloat(q.vy[i]) * PARTICLE_FIXED_ONE) * (int)age;
+					q.lifetime[i] = age;
+					q.x[i] = SDL_min(SDL_max(x, -32768), 32767);
+					q.y[i] = SDL_min(SDL_max(y, -32768), 32767);
+				}
 			}
 			else
 			{
-				SDL_SetRenderDrawColor(renderer, 255, 255, 255, alpha);
-				SDL_RenderDrawPoint(renderer, camerax + particles[i].x, cameray + particles[i].y);
-				SDL_RenderDrawRect(renderer, &particleRect);
-				SDL_RenderFillRect(renderer, &particleRect);
+				for (unsigned int i = begin; i < end; ++i)
+				{
+					const float age = floorf(ages[i - begin] * particles.lifespan[i]);
+					particles.lifetime[i] = age;
+					particles.x[i] += particles.vx[i] * age;
+					particles.y[i] += particles.vy[i] * age;
+				}
 			}
+		}
+	}
+
+	unsigned int Count() const
+	{
+		return properties.stateless ? properties.amount : particles.count;
+	}
+
+	// A burst that has let every particle die has nothing left to do.
+	bool Finished() const
+	{
+		return !properties.loop && particles.count == 0;
+	}
 
-			if (debugDraw)
+	// Makes the simulated back buffer the one Draw reads.
+	void Swap()
+	{
+		if (stepped)
+		{
+			std::swap(particles, back);
+			clock = sim_clock;
+		}
+		lag = sim_lag;
+		stepped = false;
+	}
+
+	void Draw(SDL_Renderer* renderer, float camerax, float cameray, float interpolation, bool debugDraw)
+	{
+		// deferred steps are extrapolated like the fraction of the next one
+		interpolation += lag;
+		const unsigned int drawn = properties.loop ? lod_count : (unsigned int)ceilf(particles.count * detail);
+		// fewer particles each cover 1 / detail of the area
+		const float grow = 1.0f / sqrtf(detail);
+		const bool batched = context->geometry->Batched();
+		if (batched) context->geometry->Begin(renderer, properties.texture ? properties.texture : context->atlas->SolidPage(), drawn);
+		if (properties.quantized || properties.stateless)
+		{
+			// quantized and stateless particles are expanded a batch at a time on the stack
+			alignas(PARTICLE_ALIGNMENT) float storage[PARTICLE_STREAMS * DECODE_BATCH];
+			ParticleBuffer decoded;
+			decoded.Attach(storage, DECODE_BATCH, DECODE_BATCH);
+			for (unsigned int i = 0; i < drawn; i += DECODE_BATCH)
 			{
-				SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
-				SDL_RenderDrawLine(renderer, camerax + particles[i].x, cameray + particles[i].y, camerax + particles[i].x + particles[i].vx * 10, cameray + particles[i].y + particles[i].vy * 10);
-				SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+				decoded.count = SDL_min(drawn - i, DECODE_BATCH);
+				if (properties.stateless) EvaluateStateless(spawn, seed, clock, i, i + decoded.count, decoded);
+				else DecodeQuantized(particles, i, i + decoded.count, center_x, center_y, decoded);
+				(this->*draw_particles)(renderer, decoded, i, decoded.count, camerax, cameray, interpolation, grow, debugDraw);
 			}
 		}
+		else (this->*draw_particles)(renderer, particles, 0, drawn, camerax, cameray, interpolation, grow, debugDraw);
+		if (batched) context->geometry->count += drawn;
+		else if (!properties.texture) context->geometry->Flush(renderer);
+
 		if (debugDraw)
 		{
 			SDL_SetRenderDrawColor(renderer, 0, 255, 255, 255);
@@ -178,50 +510,247 @@ public:
 		}
 	}
 
+	// interpolation is the fraction of the next step already elapsed, plus any
+	// deferred steps; positions move by vx a step, so no previous state has to
+	// be kept around.
+	// Particles as quads appended to the shared geometry batch; vertex alpha
+	// stands in for the alpha mod.
+	void DrawQuads(SDL_Renderer* renderer, const ParticleBuffer& p, unsigned int first, unsigned int count, float camerax, float cameray, float interpolation, float grow, bool debugDraw)
+	{
+		const ParticleView view{ camerax, cameray, interpolation, grow, properties.uv };
+		context->kernels->build_quads(p, count, view, context->geometry->vertices + (context->geometry->count + first) * 4);
+		if (debugDraw)
+			for (unsigned int i = 0; i < count; ++i)
+				DrawVelocity(renderer, camerax + p.x[i] + p.vx[i] * interpolation, cameray + p.y[i] + p.vy[i] * interpolation, p.vx[i], p.vy[i]);
+	}
+
+	// Without geometry batching: one copy per particle, with the alpha mod.
+	void DrawCopies(SDL_Renderer* renderer, const ParticleBuffer& p, unsigned int first, unsigned int count, float camerax, float cameray, float interpolation, float grow, bool debugDraw)
+	{
+		SDL_SetTextureBlendMode(properties.texture, SDL_BLENDMODE_BLEND);
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			const float x = p.x[i] + p.vx[i] * interpolation;
+			const float y = p.y[i] + p.vy[i] * interpolation;
+			const float w = p.w[i] * grow, h = p.h[i] * grow;
+			const float lifetime = SDL_min(p.lifetime[i] + interpolation, p.lifespan[i]);
+			unsigned int alpha = 255 * (1 - (lifetime / p.lifespan[i]));
+			SDL_Rect particleRect{ camerax + x - w / 2, cameray + y - h / 2, w, h };
+			SDL_SetTextureAlphaMod(properties.texture, alpha);
+			SDL_RenderCopy(renderer, properties.texture, &properties.source, &particleRect);
+			if (debugDraw) DrawVelocity(renderer, camerax + x, cameray + y, p.vx[i], p.vy[i]);
+		}
+	}
+
+	// The fill covers the particle's point and outline, so only it is drawn.
+	void DrawRects(SDL_Renderer* renderer, const ParticleBuffer& p, unsigned int first, unsigned int count, float camerax, float cameray, float interpolation, float grow, bool debugDraw)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			const float x = p.x[i] + p.vx[i] * interpolation;
+			const float y = p.y[i] + p.vy[i] * interpolation;
+			const float w = p.w[i] * grow, h = p.h[i] * grow;
+			const float lifetime = SDL_min(p.lifetime[i] + interpolation, p.lifespan[i]);
+			const Uint8 alpha = 255 * (1 - (lifetime / p.lifespan[i]));
+			context->geometry->Add(renderer, { camerax + x - w / 2, cameray + y - h / 2, w, h }, alpha);
+			if (debugDraw) DrawVelocity(renderer, camerax + x, cameray + y, p.vx[i], p.vy[i]);
+		}
+	}
+
+	static void DrawVelocity(SDL_Renderer* renderer, float x, float y, float vx, float vy)
+	{
+		SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+		SDL_RenderDrawLine(renderer, x, y, x + vx * 10, y + vy * 10);
+		SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+	}
+
 };
 
 class ParticleSystem
 {
 public:
 
-	List<Emitter*>* emitters = new List<Emitter*>;
+	SlotMap<Emitter> emitters;
 
 	bool pause = false;
 	bool debugDraw = false;
 	SDL_Renderer* renderer;
+	ParticleKernels kernels;
+	JobSystem jobs;
+	ParticleContext context;
+	ParticleArena arena;
+	ParticleBufferPool buffers;
+	ParticleAtlas atlas;
+	ParticleGeometry geometry;
+	Random random;
 
 	pugi::xml_document particles_config;
 	pugi::xml_node type_config;
 
 	unsigned int emitters_count = 0;
 	unsigned int particles_count = 0;
+	unsigned int sleeping_count = 0;
+	unsigned int deferred_count = 0;
+
+	// emitters whose bounds miss the view grown by sleep_margin are not
+	// simulated; naps of up to catch_up_steps are replayed on waking
+	float sleep_margin;
+	unsigned int catch_up_steps;
+
+	// particles under lod_min_size pixels across are thinned out, keeping at
+	// least lod_min_detail of each emitter; 0 turns it off
+	float lod_min_size;
+	float lod_min_detail;
+
+	// update scheduler: looping emitters are stepped up to schedule_max_period
+	// (a power of two) steps at a time, as long as their drawn particles stray
+	// under schedule_motion pixels; the particles all emitters update each
+	// frame stay within update_cap, 0 meaning no cap, except for an emitter
+	// whose one update is larger than the cap, which still runs on its own
+	float schedule_motion;
+	unsigned int schedule_max_period;
+	unsigned int update_cap;
+	unsigned int schedule_cursor = 0;
+	unsigned int tick = 0;
+
+	// budget governor: scales every emitter's density to keep the smoothed
+	// simulate + draw time within budget_ms; it only grows density again once
+	// the cost falls below budget_hysteresis under the budget. 0 turns it off.
+	// full_cost_ms smooths the frame time scaled up to density 1, so a cut
+	// measured at one density is not applied again to the next.
+	float budget_ms;
+	float budget_hysteresis;
+	float min_density;
+	float density = 1.0f;
+	float update_ms = 0.0f;
+	float draw_ms = 0.0f;
+	float full_cost_ms = 0.0f;
+	// written by the simulation, published to update_ms by Synchronize
+	float simulate_ms = 0.0f;
+
+	// frames the drawn state trails the simulation by
+	unsigned int latency_frames = 0;
+	std::atomic<int> simulating;
+
+	// fixed timestep: the config gives speeds, forces and lifespans per 1/60 s
+	// step, and every count of steps here is in those. The simulation runs at
+	// sim_rate, stepping step_span of them at a time (a power of two, so 30 Hz
+	// steps 2 and 15 Hz steps 4), at most max_steps simulated steps a frame.
+	float step_time;
+	unsigned int step_span;
+	unsigned int max_steps;
+	unsigned int steps = 0;
+	float accumulator = 0.0f;
+	float interpolation = 0.0f;
 
 	ParticleSystem(SDL_Renderer* _renderer)
 	{
-		srand(time(0));
+		unsigned int seed = time(0);
+		random.Seed(seed);
 		pugi::xml_parse_result result = particles_config.load_file("particles_config.xml");
 		if (!result) printf("ERROR while loading particles_config.xml file: %s", result.description());
 		type_config = particles_config.child("ParticleProperties");
+		pugi::xml_node engine_config = type_config.child("Engine");
+		jobs.Init(engine_config.attribute("workers").as_uint(), seed);
 		renderer = _renderer;
+		kernels.Select();
+		printf("Particle kernel: %s\n", kernels.name);
+		atlas.Build(renderer, type_config, engine_config.attribute("atlas_size").as_int(1024), engine_config.attribute("atlas_evict_frames").as_uint(300));
+
+		const unsigned int simd_width = PARTICLE_ALIGNMENT / sizeof(float);
+		context.renderer = renderer;
+		context.kernels = &kernels;
+		context.jobs = &jobs;
+		context.buffers = &buffers;
+		context.atlas = &atlas;
+		context.geometry = &geometry;
+		geometry.Load();
+		printf("Particle geometry: %s\n", geometry.Batched() ? "batched" : "per particle");
+		arena.Init(engine_config.attribute("arena_particles").as_uint(1 << 20));
+		buffers.arena = &arena;
+		context.parallel_chunk = engine_config.attribute("parallel_chunk").as_uint(16384) / simd_width * simd_width;
+		context.pipelined = engine_config.attribute("pipelined").as_bool();
+		latency_frames = context.pipelined ? 1 : 0;
+		simulating = 0;
+		const float sim_rate = engine_config.attribute("sim_rate").as_float(60.0f);
+		step_span = 1;
+		while (step_span < PARTICLE_MAX_STEP && sim_rate * step_span * 1.5f < 60.0f) step_span *= 2;
+		if (sim_rate * step_span != 60.0f) printf("ERROR sim_rate %g is not 60 divided by a power of two, using %g\n", sim_rate, 60.0f / step_span);
+		step_time = step_span / 60.0f;
+		max_steps = engine_config.attribute("max_steps").as_uint(4);
+		sleep_margin = engine_config.attribute("sleep_margin").as_float(64.0f);
+		catch_up_steps = engine_config.attribute("catch_up_steps").as_uint(16);
+		lod_min_size = engine_config.attribute("lod_min_size").as_float(4.0f);
+		lod_min_detail = engine_config.attribute("lod_min_detail").as_float(0.1f);
+		budget_ms = engine_config.attribute("budget_ms").as_float();
+		budget_hysteresis = engine_config.attribute("budget_hysteresis").as_float(0.2f);
+		min_density = engine_config.attribute("min_density").as_float(0.1f);
+		schedule_motion = engine_config.attribute("schedule_motion").as_float(1.0f);
+		schedule_max_period = engine_config.attribute("schedule_max_period").as_uint(8);
+		update_cap = engine_config.attribute("update_cap").as_uint();
+		// periods are powers of two so scaled steps stay exact, and whole
+		// simulated steps of step_span each
+		schedule_max_period = SDL_min(schedule_max_period, PARTICLE_MAX_STEP);
+		while (schedule_max_period & (schedule_max_period - 1)) schedule_max_period &= schedule_max_period - 1;
+		schedule_max_period = SDL_max(schedule_max_period, step_span);
+
+		emitters.Reserve(engine_config.attribute("emitter_capacity").as_uint());
 		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
 	}
 
 	~ParticleSystem()
 	{
-		RELEASE(emitters);
+		Synchronize();
+		for (unsigned int i = 0; i < emitters.size; ++i)
+			emitters.data[i].Release();
 	}
 
-	void AddEmitter(EmitterType type, int x, int y)
+	// Adding and removing move emitters around, so both wait for an in-flight step.
+	Handle AddEmitter(EmitterType type, int x, int y)
 	{
-		Emitter* emitter = new Emitter;
-		emitter->Init(type, x, y, type_config, renderer);
-		emitters->Add(emitter);
+		jobs.Wait(simulating);
+		Handle handle = emitters.Add();
+		Emitter* emitter = emitters.Get(handle);
+		emitter->Init(type, x, y, type_config, &context, ((uint64_t)random.Next() << 32) | random.Next());
 		++emitters_count;
 		particles_count += emitter->properties.amount;
+		return handle;
+	}
+
+	// Drops every emitter at once: the arena is simply rewound.
+	void Clear()
+	{
+		jobs.Wait(simulating);
+		for (unsigned int i = 0; i < emitters.size; ++i)
+			emitters.data[i].Release();
+		emitters.Clear();
+		buffers.Clear();
+		arena.Reset();
+		emitters_count = 0;
+		particles_count = 0;
 	}
 
-	void Update(float dt, int* mouse, int* keyboard, float scale)
+	bool RemoveEmitter(Handle handle)
 	{
+		jobs.Wait(simulating);
+		Emitter* emitter = emitters.Get(handle);
+		if (!emitter) return false;
+		particles_count -= emitter->Count();
+		emitter->Release();
+		emitters.Del(handle);
+		--emitters_count;
+		return true;
+	}
+
+	// camerax, cameray and scale are the view Draw will render with.
+	void Update(float dt, int* mouse, int* keyboard, float scale, float camerax, float cameray)
+	{
+		// the frame simulated while the last one was drawn goes on screen now
+		Synchronize();
+		Retire();
+		atlas.Age();
+		Govern();
+
 		if (keyboard[SDL_SCANCODE_1] == 1) AddEmitter(EmitterType::SPARKLES, mouse[0] / scale, mouse[1] / scale);
 		if (keyboard[SDL_SCANCODE_2] == 1) AddEmitter(EmitterType::RAIN, mouse[0] / scale, mouse[1] / scale);
 		if (keyboard[SDL_SCANCODE_3] == 1) AddEmitter(EmitterType::SNOW, mouse[0] / scale, mouse[1] / scale);
@@ -229,19 +758,213 @@ public:
 		if (keyboard[SDL_SCANCODE_5] == 1) AddEmitter(EmitterType::SMOKE, mouse[0] / scale, mouse[1] / scale);
 		if (keyboard[SDL_SCANCODE_6] == 1) AddEmitter(EmitterType::FIREWORKS, mouse[0] / scale, mouse[1] / scale);
 
+		if (keyboard[SDL_SCANCODE_C] == 1) Clear();
 		if (keyboard[SDL_SCANCODE_D] == 1) debugDraw = !debugDraw;
 		if (keyboard[SDL_SCANCODE_S] == 1) pause = !pause;
 
-		if (emitters->start && !pause)
-			for (ListItem<Emitter*>* emitter = emitters->start; emitter; emitter = emitter->next)
-				emitter->data->Update(dt);
+		if (emitters.size && !pause)
+		{
+			accumulator += dt;
+			unsigned int due = accumulator / step_time;
+			// a backlog beyond max_steps is dropped so slow frames cannot snowball
+			steps = SDL_min(due, max_steps) * step_span;
+			accumulator -= due * step_time;
+			interpolation = accumulator / step_time * step_span;
+
+			Cull(camerax, cameray, scale);
+			if (steps > 0) Schedule();
+
+			if (steps > 0 && context.pipelined)
+			{
+				// the workers step the next frame while the main thread draws this one
+				simulating = 1;
+				jobs.Push({ SimulateJob, this, nullptr, 0, 0, &simulating });
+			}
+			else if (steps > 0) Simulate();
+		}
+	}
+
+	// Puts emitters outside the view to sleep, wakes the ones back in it and
+	// sets the level of detail and update period of the awake ones.
+	void Cull(float camerax, float cameray, float scale)
+	{
+		// Draw puts world x at (camerax + x) * scale on screen
+		int view_w = 0, view_h = 0;
+		SDL_GetRendererOutputSize(renderer, &view_w, &view_h);
+		const float left = -camerax, top = -cameray;
+		const float right = -camerax + view_w / scale, bottom = -cameray + view_h / scale;
+
+		sleeping_count = 0;
+		for (unsigned int i = 0; i < emitters.size; ++i)
+		{
+			Emitter& emitter = emitters.data[i];
+			const SDL_FRect& b = emitter.bounds;
+			emitter.SetVisible(Overlaps(b, left - sleep_margin, top - sleep_margin, right + sleep_margin, bottom + sleep_margin), catch_up_steps);
+			if (emitter.asleep)
+			{
+				emitter.slept += steps;
+				++sleeping_count;
+				continue;
+			}
+			emitter.SetDetail(scale, lod_min_size, lod_min_detail, density);
+			emitter.SetPeriod(scale, Overlaps(b, left, top, right, bottom), schedule_motion, step_span, schedule_max_period);
+			emitter.deferred += steps;
+		}
+	}
+
+	static bool Overlaps(const SDL_FRect& b, float left, float top, float right, float bottom)
+	{
+		return b.x < right && b.x + b.w > left && b.y < bottom && b.y + b.h > top;
+	}
+
+	// Turns deferred steps into this frame's updates. Emitters stepped every
+	// simulated step run whenever they have steps; the others when their
+	// period comes round, staggered by phase, or once overdue. They are all
+	// visited round-robin from the one the cap stopped at last frame and run
+	// as many of their updates as still fit under update_cap particles. An
+	// update is never split, so when nothing has run yet the first emitter
+	// still gets one: a single emitter larger than the cap keeps moving and
+	// is the only way a frame goes past it.
+	void Schedule()
+	{
+		tick += steps;
+		unsigned int cost = 0;
+		deferred_count = 0;
+		unsigned int cursor = schedule_cursor;
+		bool capped = false;
+		for (unsigned int n = 0; n < emitters.size; ++n)
+		{
+			const unsigned int i = (schedule_cursor + n) % emitters.size;
+			Emitter& emitter = emitters.data[i];
+			emitter.updates = 0;
+			if (emitter.asleep) continue;
+
+			// like the frame accumulator, a backlog beyond max_steps updates is dropped
+			emitter.deferred = SDL_min(emitter.deferred, emitter.period * max_steps);
+			const bool due = emitter.period <= step_span || (tick + emitter.phase) % emitter.period < steps || steps >= emitter.period;
+			const unsigned int updates = emitter.deferred / emitter.period;
+			if (updates == 0 || (!due && updates < 2))
+			{
+				++deferred_count;
+				continue;
+			}
+			unsigned int run = updates;
+			const unsigned int load = emitter.Load();
+			if (update_cap && load && cost + updates * load > update_cap)
+			{
+				run = cost < update_cap ? (update_cap - cost) / load : 0;
+				if (cost == 0) run = SDL_max(run, 1u);
+				if (!capped) cursor = i;
+				capped = true;
+			}
+			if (run == 0)
+			{
+				++deferred_count;
+				continue;
+			}
+			emitter.updates = run;
+			emitter.deferred -= run * emitter.period;
+			cost += run * load;
+		}
+		schedule_cursor = cursor;
+
+		// the state drawn next lags behind by the steps still deferred
+		for (unsigned int i = 0; i < emitters.size; ++i)
+		{
+			Emitter& emitter = emitters.data[i];
+			emitter.sim_lag = emitter.deferred;
+			if (!context.pipelined) emitter.lag = emitter.sim_lag;
+		}
+	}
+
+	void Simulate()
+	{
+		const Uint64 start = SDL_GetPerformanceCounter();
+		unsigned int scheduled = 0;
+		for (unsigned int i = 0; i < emitters.size; ++i)
+			if (emitters.data[i].updates) ++scheduled;
+		std::atomic<int> pending(scheduled);
+		for (unsigned int i = 0; i < emitters.size; ++i)
+			if (emitters.data[i].updates) jobs.Push({ UpdateEmitterJob, this, &emitters.data[i], 0, 0, &pending });
+		jobs.Wait(pending);
+		simulate_ms = Milliseconds(start);
+	}
+
+	// Adjusts density from the last frame's cost, which was simulated and drawn
+	// at the current density: over budget it drops to the density that fits at
+	// once, comfortably under it grows back 5% a frame up to the edge of the
+	// hysteresis band. A pipelined simulation overlaps the drawing, so only
+	// the longer of the two counts.
+	void Govern()
+	{
+		const float frame_ms = context.pipelined ? SDL_max(update_ms, draw_ms) : update_ms + draw_ms;
+		if (density > 0.0f) full_cost_ms = full_cost_ms * 0.9f + frame_ms / density * 0.1f;
+		if (budget_ms <= 0.0f || full_cost_ms <= 0.0f) return;
+
+		const float cost_ms = full_cost_ms * density;
+		const float low_ms = budget_ms * (1.0f - budget_hysteresis);
+		if (cost_ms > budget_ms) density = SDL_max(budget_ms / full_cost_ms, min_density);
+		else if (cost_ms < low_ms) density = SDL_min(SDL_min(density * 1.05f, low_ms / full_cost_ms), 1.0f);
+	}
+
+	static float Milliseconds(Uint64 start)
+	{
+		return (SDL_GetPerformanceCounter() - start) * 1000.0f / SDL_GetPerformanceFrequency();
+	}
+
+	ParticleStats Stats() const
+	{
+		return { emitters_count, particles_count, sleeping_count, deferred_count, latency_frames, atlas.Textures(), density, update_ms, draw_ms };
+	}
+
+	static void SimulateJob(void* system, void* data, unsigned int begin, unsigned int end)
+	{
+		((ParticleSystem*)system)->Simulate();
+	}
+
+	static void UpdateEmitterJob(void* system, void* emitter, unsigned int begin, unsigned int end)
+	{
+		Emitter* e = (Emitter*)emitter;
+		for (unsigned int update = 0; update < e->updates; ++update)
+			e->Update(e->period);
+	}
+
+	// Removes finished bursts and recounts the live particles.
+	void Retire()
+	{
+		particles_count = 0;
+		for (unsigned int i = 0; i < emitters.size;)
+		{
+			if (emitters.data[i].Finished())
+			{
+				// the last emitter is swapped into slot i, so i is not advanced
+				emitters.data[i].Release();
+				emitters.Del(emitters.HandleAt(i));
+				--emitters_count;
+			}
+			else particles_count += emitters.data[i++].Count();
+		}
+	}
+
+	// Waits for an in-flight simulation step and publishes its results.
+	void Synchronize()
+	{
+		jobs.Wait(simulating);
+		update_ms = simulate_ms;
+		simulate_ms = 0.0f;
+		if (context.pipelined)
+			for (unsigned int i = 0; i < emitters.size; ++i)
+				emitters.data[i].Swap();
 	}
 
 	void Draw(float camerax, float cameray)
 	{
-		if (emitters->start)
-			for (ListItem<Emitter*>* emitter = emitters->start; emitter; emitter = emitter->next)
-				emitter->data->Draw(renderer, camerax, cameray, debugDraw);
+		const Uint64 start = SDL_GetPerformanceCounter();
+		for (unsigned int i = 0; i < emitters.size; ++i)
+			if (!emitters.data[i].asleep) emitters.data[i].Draw(renderer, camerax, cameray, interpolation, debugDraw);
+		// the last batch is still waiting
+		geometry.Flush(renderer);
+		draw_ms = Milliseconds(start);
 	}
 
 };
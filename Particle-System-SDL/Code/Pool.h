@@ -0,0 +1,48 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+// Stack of released items that are handed out again before anything new is
+// allocated. It only grows, so a warmed-up pool never touches the heap.
+template<class tdata>
+class Pool
+{
+public:
+
+	tdata* items;
+	unsigned int size;
+	unsigned int capacity;
+
+	Pool()
+	{
+		items = 0;
+		size = capacity = 0;
+	}
+
+	~Pool()
+	{
+		delete[] items;
+	}
+
+	void Put(const tdata& item)
+	{
+		if (size == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 16;
+			tdata* newItems = new tdata[capacity];
+			for (unsigned int i = 0; i < size; ++i) newItems[i] = items[i];
+			delete[] items;
+			items = newItems;
+		}
+		items[size++] = item;
+	}
+
+	bool Get(tdata& item)
+	{
+		if (!size) return false;
+		item = items[--size];
+		return true;
+	}
+
+};
+
+#endif
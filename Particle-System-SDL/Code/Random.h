@@ -0,0 +1,106 @@
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+#include <stdint.h>
+#include <emmintrin.h>
+
+#define RANDOM_LANES 4
+
+// xoshiro128+ generator: a few adds, shifts and xors per number and no shared
+// state, so every emitter and worker thread can own one. Fill runs four
+// independent generators side by side in SSE2 registers.
+struct Random
+{
+	uint32_t s[4];
+	// lanes[word * RANDOM_LANES + lane] holds the state of the batch generators
+	alignas(16) uint32_t lanes[4 * RANDOM_LANES];
+
+	Random()
+	{
+		Seed(0);
+	}
+
+	void Seed(uint64_t seed)
+	{
+		for (int i = 0; i < 4; ++i) s[i] = SplitMix(seed);
+		for (int i = 0; i < 4 * RANDOM_LANES; ++i) lanes[i] = SplitMix(seed);
+	}
+
+	uint32_t Next()
+	{
+		const uint32_t result = s[0] + s[3];
+		const uint32_t t = s[1] << 9;
+
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = (s[3] << 11) | (s[3] >> 21);
+
+		return result;
+	}
+
+	// Uniform in [min, max); only the top 24 bits are used, which are the
+	// well mixed ones and exactly what a float mantissa holds.
+	float Float(float min, float max)
+	{
+		return Uniform(Next(), min, max);
+	}
+
+	static float Uniform(uint32_t bits, float min, float max)
+	{
+		return min + (max - min) * ((bits >> 8) * (1.0f / 16777216.0f));
+	}
+
+	// Writes count uniforms in [min, max) to out.
+	void Fill(float* out, unsigned int count, float min, float max)
+	{
+		__m128i s0 = _mm_load_si128((const __m128i*)(lanes + 0 * RANDOM_LANES));
+		__m128i s1 = _mm_load_si128((const __m128i*)(lanes + 1 * RANDOM_LANES));
+		__m128i s2 = _mm_load_si128((const __m128i*)(lanes + 2 * RANDOM_LANES));
+		__m128i s3 = _mm_load_si128((const __m128i*)(lanes + 3 * RANDOM_LANES));
+		const __m128 base = _mm_set1_ps(min);
+		const __m128 range = _mm_set1_ps((max - min) * (1.0f / 16777216.0f));
+
+		unsigned int i = 0;
+		for (; i + RANDOM_LANES <= count; i += RANDOM_LANES)
+		{
+			const __m128i result = _mm_add_epi32(s0, s3);
+			const __m128i t = _mm_slli_epi32(s1, 9);
+
+			s2 = _mm_xor_si128(s2, s0);
+			s3 = _mm_xor_si128(s3, s1);
+			s1 = _mm_xor_si128(s1, s2);
+			s0 = _mm_xor_si128(s0, s3);
+			s2 = _mm_xor_si128(s2, t);
+			s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+
+			const __m128 bits = _mm_cvtepi32_ps(_mm_srli_epi32(result, 8));
+			_mm_storeu_ps(out + i, _mm_add_ps(base, _mm_mul_ps(bits, range)));
+		}
+
+		_mm_store_si128((__m128i*)(lanes + 0 * RANDOM_LANES), s0);
+		_mm_store_si128((__m128i*)(lanes + 1 * RANDOM_LANES), s1);
+		_mm_store_si128((__m128i*)(lanes + 2 * RANDOM_LANES), s2);
+		_mm_store_si128((__m128i*)(lanes + 3 * RANDOM_LANES), s3);
+
+		for (; i < count; ++i) out[i] = Float(min, max);
+	}
+
+	static uint32_t SplitMix(uint64_t& state)
+	{
+		return (uint32_t)(Mix(state += 0x9E3779B97F4A7C15ull) >> 32);
+	}
+
+	// SplitMix64 finalizer: hashes a key to well mixed bits, for values that
+	// are recomputed from their key instead of stored.
+	static uint64_t Mix(uint64_t z)
+	{
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef __SLOTMAP_H__
+#define __SLOTMAP_H__
+
+// Refers to an item in a SlotMap; it goes stale once that item is removed.
+struct Handle
+{
+	unsigned int index;
+	unsigned int generation;
+};
+
+// Items live packed in data[0, size) so iterating is a linear scan. Handles
+// go through a slot table that follows items as removals swap the last item
+// into the hole, and a per-slot generation rejects handles to removed items.
+template<class tdata>
+class SlotMap
+{
+public:
+
+	tdata* data;
+	unsigned int size;
+	unsigned int capacity;
+
+	SlotMap()
+	{
+		data = 0;
+		dense_slots = slots = generations = 0;
+		size = capacity = slots_used = 0;
+		free_slot = INVALID_SLOT;
+	}
+
+	~SlotMap()
+	{
+		delete[] data;
+		delete[] dense_slots;
+		delete[] slots;
+		delete[] generations;
+	}
+
+	void Reserve(unsigned int _capacity)
+	{
+		if (_capacity <= capacity) return;
+
+		tdata* newData = new tdata[_capacity];
+		unsigned int* newDenseSlots = new unsigned int[_capacity];
+		unsigned int* newSlots = new unsigned int[_capacity];
+		unsigned int* newGenerations = new unsigned int[_capacity];
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			newData[i] = data[i];
+			newDenseSlots[i] = dense_slots[i];
+		}
+		for (unsigned int i = 0; i < slots_used; ++i)
+		{
+			newSlots[i] = slots[i];
+			newGenerations[i] = generations[i];
+		}
+
+		delete[] data;
+		delete[] dense_slots;
+		delete[] slots;
+		delete[] generations;
+		data = newData;
+		dense_slots = newDenseSlots;
+		slots = newSlots;
+		generations = newGenerations;
+		capacity = _capacity;
+	}
+
+	// Appends a default item at data[size - 1] and returns its handle.
+	Handle Add()
+	{
+		if (size == capacity) Reserve(capacity ? capacity * 2 : 16);
+
+		unsigned int slot;
+		if (free_slot != INVALID_SLOT)
+		{
+			slot = free_slot;
+			free_slot = slots[slot];
+		}
+		else
+		{
+			slot = slots_used++;
+			generations[slot] = 0;
+		}
+
+		data[size] = tdata();
+		slots[slot] = size;
+		dense_slots[size] = slot;
+		++size;
+
+		return { slot, generations[slot] };
+	}
+
+	tdata* Get(Handle handle)
+	{
+		if (handle.index >= slots_used || generations[handle.index] != handle.generation) return 0;
+		return &data[slots[handle.index]];
+	}
+
+	Handle HandleAt(unsigned int dense)
+	{
+		return { dense_slots[dense], generations[dense_slots[dense]] };
+	}
+
+	// Removes every item; all outstanding handles go stale.
+	void Clear()
+	{
+		free_slot = INVALID_SLOT;
+		for (unsigned int i = 0; i < slots_used; ++i)
+		{
+			++generations[i];
+			slots[i] = free_slot;
+			free_slot = i;
+		}
+		size = 0;
+	}
+
+	bool Del(Handle handle)
+	{
+		if (!Get(handle)) return false;
+
+		unsigned int dense = slots[handle.index];
+		unsigned int last = size - 1;
+		data[dense] = data[last];
+		dense_slots[dense] = dense_slots[last];
+		slots[dense_slots[dense]] = dense;
+		--size;
+
+		++generations[handle.index];
+		slots[handle.index] = free_slot;
+		free_slot = handle.index;
+		return true;
+	}
+
+private:
+
+	static const unsigned int INVALID_SLOT = 0xFFFFFFFF;
+
+	// dense index -> slot, and slot -> dense index (or the next free slot)
+	unsigned int* dense_slots;
+	unsigned int* slots;
+	unsigned int* generations;
+	unsigned int slots_used;
+	unsigned int free_slot;
+
+};
+
+#endif
@@ -0,0 +1,213 @@
+// Runs every SIMD particle kernel against its scalar reference: both step the
+// same particles through the update and respawn passes an emitter makes and
+// must agree bit for bit after every step, and both build the same vertices.
+// Variants the CPU lacks are skipped.
+// Returns the number of mismatching runs.
+#include <stdio.h>
+#include <string.h>
+
+// a plain console program, without SDL2main
+#define SDL_MAIN_HANDLED
+#include "ParticleKernels.h"
+
+#define TEST_STEPS 2000
+
+static const UpdateFunction update_scalar[] = { UpdateParticlesScalar<0>, UpdateParticlesScalar<1>, UpdateParticlesScalar<2>, UpdateParticlesScalar<3> };
+static const UpdateFunction update_sse41[] = { UpdateParticlesSSE41<0>, UpdateParticlesSSE41<1>, UpdateParticlesSSE41<2>, UpdateParticlesSSE41<3> };
+static const UpdateFunction update_avx2[] = { UpdateParticlesAVX2<0>, UpdateParticlesAVX2<1>, UpdateParticlesAVX2<2>, UpdateParticlesAVX2<3> };
+static const UpdateFunction update_avx512[] = { UpdateParticlesAVX512<0>, UpdateParticlesAVX512<1>, UpdateParticlesAVX512<2>, UpdateParticlesAVX512<3> };
+static const UpdateFunction quantized_scalar[] = { UpdateQuantizedScalar<0>, UpdateQuantizedScalar<1>, UpdateQuantizedScalar<2>, UpdateQuantizedScalar<3> };
+static const UpdateFunction quantized_avx2[] = { UpdateQuantizedAVX2<0>, UpdateQuantizedAVX2<1>, UpdateQuantizedAVX2<2>, UpdateQuantizedAVX2<3> };
+
+static const RespawnFunction respawn_scalar[] = { RespawnParticles<ScatterScalar, false>, RespawnParticles<ScatterScalar, true> };
+static const RespawnFunction respawn_avx512[] = { RespawnParticles<ScatterAVX512, false>, RespawnParticles<ScatterAVX512, true> };
+static const RespawnFunction respawn_quantized[] = { RespawnQuantized<false>, RespawnQuantized<true> };
+
+// One emitter's worth of particles stepped like Emitter::Update does it:
+// batches of RESPAWN_BATCH, expired particles respawned after each batch and,
+// without KERNEL_LOOP, dead ones compacted away. Doubled steps from one buffer
+// into the other, like a pipelined emitter; otherwise in place.
+struct KernelRun
+{
+	UpdateFunction update;
+	RespawnFunction respawn;
+	unsigned int features;
+	bool quantized;
+	bool doubled;
+	ParticleBuffer buffers[2];
+	unsigned int current;
+	ParticleSpawn spawn;
+	ParticleForces forces;
+	Random random;
+
+	void Init(UpdateFunction _update, RespawnFunction _respawn, unsigned int _features, bool _quantized, bool _doubled, unsigned int count, float step)
+	{
+		update = _update;
+		respawn = _respawn;
+		features = _features;
+		quantized = _quantized;
+		doubled = _doubled;
+		current = 0;
+		// quantized positions are relative to the emitter center and stay in range
+		spawn = { 1.0f, 2500.0f, -300.0f, 300.0f, -200.0f, 200.0f, -1.0f, 1.0f, -2.0f, 0.5f, 1.0f, 4.0f, 1.0f, 4.0f };
+		forces = { 20.0f, -10.0f, 0.05f * step, 0.03f * step, step };
+		random.Seed(1234);
+
+		for (int i = 0; i < (doubled ? 2 : 1); ++i)
+		{
+			buffers[i].Allocate(quantized ? QuantizedParticles::StorageCapacity(count) : count);
+			memset(buffers[i].block, 0, PARTICLE_STREAMS * buffers[i].stride * sizeof(float));
+			buffers[i].count = count;
+		}
+
+		unsigned int indices[RESPAWN_BATCH];
+		for (unsigned int i = 0; i < count; i += RESPAWN_BATCH)
+		{
+			const unsigned int batch = SDL_min(count - i, RESPAWN_BATCH);
+			for (unsigned int k = 0; k < batch; ++k) indices[k] = i + k;
+			respawn(buffers[0], indices, batch, spawn, random);
+		}
+	}
+
+	void Free()
+	{
+		buffers[0].Free();
+		buffers[1].Free();
+	}
+
+	void Step()
+	{
+		const ParticleBuffer& in = buffers[current];
+		ParticleBuffer& out = buffers[doubled ? 1 - current : current];
+		out.count = in.count;
+
+		unsigned int expired[RESPAWN_BATCH];
+		for (unsigned int i = 0; i < in.count; i += RESPAWN_BATCH)
+		{
+			const unsigned int count = update(in, out, i, SDL_min(i + RESPAWN_BATCH, in.count), forces, expired);
+			if (count) respawn(out, expired, count, spawn, random);
+		}
+		if (!(features & KERNEL_LOOP))
+		{
+			if (quantized) QuantizedParticles(out).Compact(out.count);
+			else out.Compact();
+		}
+		if (doubled) current = 1 - current;
+	}
+
+	const ParticleBuffer& State() const
+	{
+		return buffers[current];
+	}
+};
+
+static bool Same(const KernelRun& a, const KernelRun& b)
+{
+	const ParticleBuffer& pa = a.State();
+	const ParticleBuffer& pb = b.State();
+	if (pa.count != pb.count) return false;
+	if (a.quantized)
+	{
+		const QuantizedParticles qa(pa), qb(pb);
+		const void* sa[] = { qa.lifetime, qa.lifespan, qa.x, qa.y, qa.vx, qa.vy, qa.w, qa.h };
+		const void* sb[] = { qb.lifetime, qb.lifespan, qb.x, qb.y, qb.vx, qb.vy, qb.w, qb.h };
+		for (int s = 0; s < 8; ++s)
+			if (memcmp(sa[s], sb[s], pa.count * sizeof(uint16_t))) return false;
+		return true;
+	}
+	const float* sa[] = { pa.lifetime, pa.lifespan, pa.x, pa.y, pa.vx, pa.vy, pa.w, pa.h };
+	const float* sb[] = { pb.lifetime, pb.lifespan, pb.x, pb.y, pb.vx, pb.vy, pb.w, pb.h };
+	for (int s = 0; s < 8; ++s)
+		if (memcmp(sa[s], sb[s], pa.count * sizeof(float))) return false;
+	return true;
+}
+
+// Steps a reference and a tested kernel side by side; false on the first
+// step they disagree.
+static bool Compare(const char* name, UpdateFunction reference, UpdateFunction tested, RespawnFunction reference_respawn, RespawnFunction tested_respawn,
+	unsigned int features, bool quantized, bool sized, bool doubled, unsigned int count, float step)
+{
+	KernelRun a, b;
+	a.Init(reference, reference_respawn, features, quantized, false, count, step);
+	b.Init(tested, tested_respawn, features, quantized, doubled, count, step);
+	int failed = Same(a, b) ? -1 : 0;
+	for (int i = 1; i <= TEST_STEPS && failed < 0; ++i)
+	{
+		a.Step();
+		b.Step();
+		if (!Same(a, b)) failed = i;
+	}
+	a.Free();
+	b.Free();
+
+	if (failed >= 0)
+		printf("ERROR %s kernel differs from scalar at step %d (features %u, %s, %s, %u particles, step %g)\n", name, failed, features,
+			sized ? "sized" : "fixed size", doubled ? "double buffered" : "in place", count, step);
+	return failed < 0;
+}
+
+// Builds the same particles' quads with the scalar and AVX2 vertex kernels,
+// including lifetimes past the lifespan, which fade out completely.
+static bool CompareQuads(unsigned int count, float interpolation, float grow)
+{
+	ParticleBuffer p;
+	p.Allocate(count);
+	p.count = count;
+	Random random;
+	random.Seed(count);
+	float* streams[] = { p.lifetime, p.lifespan, p.x, p.y, p.vx, p.vy, p.w, p.h };
+	const float ranges[][2] = { { 0.0f, 3000.0f }, { 1.0f, 2500.0f }, { -300.0f, 900.0f }, { -200.0f, 700.0f },
+		{ -1.0f, 1.0f }, { -2.0f, 0.5f }, { 1.0f, 64.0f }, { 1.0f, 64.0f } };
+	for (int s = 0; s < 8; ++s) random.Fill(streams[s], count, ranges[s][0], ranges[s][1]);
+
+	const ParticleView view{ 13.25f, -7.5f, interpolation, grow, { 0.125f, 0.5f, 0.25f, 0.375f } };
+	ParticleVertex* a = new ParticleVertex[count * 4];
+	ParticleVertex* b = new ParticleVertex[count * 4];
+	memset(a, 0, count * 4 * sizeof(ParticleVertex));
+	memset(b, 0, count * 4 * sizeof(ParticleVertex));
+	BuildQuadsScalar(p, count, view, a);
+	BuildQuadsAVX2(p, count, view, b);
+	const bool same = !memcmp(a, b, count * 4 * sizeof(ParticleVertex));
+	delete[] a;
+	delete[] b;
+	p.Free();
+
+	if (!same) printf("ERROR avx2 vertex kernel differs from scalar (%u particles, interpolation %g, grow %g)\n", count, interpolation, grow);
+	return same;
+}
+
+int main(int argc, char* argv[])
+{
+	const bool sse41 = SDL_HasSSE41(), avx2 = SDL_HasAVX2(), avx512 = SDL_HasAVX512F();
+	printf("Testing kernels: sse41 %s, avx2 %s, avx512 %s\n", sse41 ? "yes" : "skipped", avx2 ? "yes" : "skipped", avx512 ? "yes" : "skipped");
+
+	int failures = 0, runs = 0;
+	const unsigned int counts[] = { 1000, 1003 };
+	const float steps[] = { 1.0f, 8.0f };
+	for (unsigned int count : counts)
+		for (float step : steps)
+			for (unsigned int features = 0; features < KERNEL_VARIANTS; ++features)
+				for (int sized = 0; sized < 2; ++sized)
+					for (int doubled = 0; doubled < 2; ++doubled)
+					{
+						if (sse41) failures += !Compare("sse41", update_scalar[features], update_sse41[features], respawn_scalar[sized], respawn_scalar[sized], features, false, sized, doubled, count, step);
+						if (avx2) failures += !Compare("avx2", update_scalar[features], update_avx2[features], respawn_scalar[sized], respawn_scalar[sized], features, false, sized, doubled, count, step);
+						if (avx512) failures += !Compare("avx512", update_scalar[features], update_avx512[features], respawn_scalar[sized], respawn_avx512[sized], features, false, sized, doubled, count, step);
+						if (avx2) failures += !Compare("quantized avx2", quantized_scalar[features], quantized_avx2[features], respawn_quantized[sized], respawn_quantized[sized], features, true, sized, doubled, count, step);
+						runs += sse41 + avx2 * 2 + avx512;
+					}
+
+	const float interpolations[] = { 0.0f, 0.37f, 3.5f };
+	const float grows[] = { 1.0f, 1.7f };
+	if (avx2)
+		for (unsigned int count : counts)
+			for (float interpolation : interpolations)
+				for (float grow : grows)
+				{
+					failures += !CompareQuads(count, interpolation, grow);
+					++runs;
+				}
+
+	printf("%d of %d kernel runs matched\n", runs - failures, runs);
+	return failures;
+}